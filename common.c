@@ -1,4 +1,6 @@
+#define _GNU_SOURCE /* for syncfs */
 #include "get-comics.h"
+#include <limits.h>
 #include <regex.h>
 
 /* Globals and some helper functions common to all the executables. */
@@ -13,6 +15,11 @@ int want_extensions;
 const char *method = "GET";
 int thread_limit = THREAD_LIMIT;
 int unlink_index = 1;
+int max_segments;
+int early_data;
+int want_preconnect;
+int want_fastopen;
+int reactors;
 
 
 struct connection *comics;
@@ -34,6 +41,18 @@ char *must_strdup(const char *old)
 	return new;
 }
 
+double now(void)
+{
+#ifdef _WIN32
+	return GetTickCount() / 1000.0;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
 void *must_calloc(int nmemb, int size)
 {
 	void *new = calloc(nmemb, size);
@@ -102,10 +121,107 @@ int is_imgtype(const char *ext)
 	return strcmp(ext, ".xxx") == 0;
 }
 
+/* Outputs are written to fname.part and renamed when complete, so a
+ * failed or killed run never leaves a truncated file behind. */
+int open_output(struct connection *conn, const char *fname)
+{
+	conn->tmpname = must_alloc(strlen(fname) + sizeof(HEDGE_EXT TMP_EXT));
+	sprintf(conn->tmpname, "%s%s" TMP_EXT, fname,
+			conn->is_hedge ? HEDGE_EXT : "");
+
+	conn->out = open(conn->tmpname, WRITE_FLAGS, 0664);
+	if (conn->out < 0) {
+		my_perror(conn->tmpname);
+		free(conn->tmpname);
+		conn->tmpname = NULL;
+		return 1;
+	}
+
+	conn->written = 0;
+	return 0;
+}
+
+int commit_output(struct connection *conn)
+{
+	char fname[PATH_MAX];
+	int rc = 0;
+
+	if (conn->out >= 0) {
+		if (close(conn->out)) {
+			my_perror(conn->tmpname);
+			rc = 1;
+		}
+		conn->out = -1;
+	}
+
+	if (!conn->tmpname)
+		return rc;
+
+	snprintf(fname, sizeof(fname), "%s", conn->tmpname);
+	fname[strlen(fname) - strlen(TMP_EXT)] = '\0';
+
+#ifdef _WIN32
+	unlink(fname); /* rename will not replace */
+#endif
+	if (rc == 0 && rename(conn->tmpname, fname)) {
+		my_perror(fname);
+		rc = 1;
+	}
+
+	if (rc)
+		unlink(conn->tmpname);
+	free(conn->tmpname);
+	conn->tmpname = NULL;
+
+	return rc;
+}
+
+void discard_output(struct connection *conn)
+{
+	if (conn->out >= 0) {
+		close(conn->out);
+		conn->out = -1;
+	}
+
+	if (conn->tmpname) {
+		unlink(conn->tmpname);
+		free(conn->tmpname);
+		conn->tmpname = NULL;
+	}
+}
+
+/* One sync for the whole run rather than an fsync per file. We have
+ * done a chdir to the output dir. */
+void sync_outputs(void)
+{
+#ifdef __linux__
+	int fd = open(".", O_RDONLY);
+	if (fd < 0 || syncfs(fd))
+		my_perror("syncfs");
+	if (fd >= 0)
+		close(fd);
+#elif !defined(_WIN32)
+	sync();
+#endif
+}
+
 /* Normal way to close connection */
 int close_connection(struct connection *conn)
 {
+#ifndef WANT_CURL
+	if (conn->parent)
+		return close_segment(conn, 1);
+	if (conn->hedge && !(conn = hedge_won(conn)))
+		return 0;
+	if (conn->range_end && split_connection(conn) == 0)
+		return 0;
+
+	if (CONN_OPEN || conn->pending) {
+#else
 	if (CONN_OPEN) {
+#endif
+		if (commit_output(conn))
+			return fail_connection(conn);
 		++gotit;
 		conn->gotit = 1;
 		--outstanding;
@@ -114,6 +230,11 @@ int close_connection(struct connection *conn)
 		if (debug_fp)
 			fprintf(debug_fp, "%ld:   Closed %3d (%d)\n",
 					time(NULL), conn->id, outstanding);
+		store_finish(conn);
+		update_validator(conn, conn->outname);
+		sched_done(conn);
+		conn->stats.bytes += conn->written;
+		stats_mark(&conn->stats.done);
 	} else
 		printf("Multiple Closes: %s\n", conn->url);
 	return release_connection(conn);
@@ -123,35 +244,113 @@ int close_connection(struct connection *conn)
 /* Abnormal way to close connection */
 int fail_connection(struct connection *conn)
 {
+#ifndef WANT_CURL
+	if (conn->is_warm) {
+		drop_preconnect(conn);
+		return 0;
+	}
+	if (conn->parent)
+		return close_segment(conn, 0);
+	if (conn->hedge && hedge_lost(conn))
+		return 0;
+
+	if (CONN_OPEN || conn->pending) {
+#else
 	if (CONN_OPEN) {
+#endif
 		--outstanding;
 		if (verbose > 1)
 			printf("Failed %s (%d)\n", conn->url, outstanding);
 		if (debug_fp)
 			fprintf(debug_fp, "%ld:   Failed %3d (%d)\n",
 					time(NULL), conn->id, outstanding);
+		sched_done(conn);
+		conn->stats.bytes += conn->written;
+		stats_mark(&conn->stats.done);
 	} else
 		printf("Multiple Closes: %s\n", conn->url);
 	return release_connection(conn);
 }
 
 #ifndef WANT_CURL
-/* Reset connection - try again */
-int reset_connection(struct connection *conn)
+/* We can ask for the rest of a plain body if we can tell the server
+ * which version we have. Weak ETags are not allowed in If-Range. */
+static int can_resume(struct connection *conn)
+{
+	if (!conn->tmpname || conn->written == 0 || conn->decoder)
+		return 0;
+	if (conn->etag && strncmp(conn->etag, "W/", 2))
+		return 1;
+	return conn->lastmod != NULL;
+}
+
+/* Try again later. The connection goes back on the queue for secs
+ * seconds, or an exponential backoff with jitter if secs is 0. */
+int retry_connection(struct connection *conn, int secs)
 {
+	static int seeded;
+	double delay;
+
+	if (conn->hedge || conn->is_hedge) /* the other one carries on */
+		return fail_connection(conn);
+
 	++conn->reset;
 	if (conn->reset == 1)
 		++resets; /* only count each connection once */
-	if (conn->reset > 2)
+	sched_loss();
+	if (conn->reset > MAX_RETRIES) {
+		stats_fail(conn, "resets");
+		return fail_connection(conn);
+	}
+	if (secs > RETRY_MAX) {
+		printf("%s: Retry-After %d too long\n", conn->url, secs);
+		stats_fail(conn, "throttled");
 		return fail_connection(conn);
+	}
 
-	release_connection(conn);
+	if (secs)
+		delay = secs;
+	else {
+		if (!seeded) {
+			srand(time(NULL) ^ getpid());
+			seeded = 1;
+		}
+		/* Half fixed, half random so retries do not bunch up */
+		delay = RETRY_MS / 1000.0 * (1 << (conn->reset - 1));
+		delay = delay / 2 + delay / 2 * rand() / RAND_MAX;
+	}
 
-	if (build_request(conn))
-		return fail_connection(conn);
+	if (can_resume(conn)) {
+		/* Keep the partial file. build_request will ask for
+		 * the rest. */
+		char *tmpname = conn->tmpname;
+
+		close(conn->out);
+		conn->out = -1;
+		conn->tmpname = NULL;
+		release_connection(conn);
+		conn->tmpname = tmpname;
+		if (verbose)
+			printf("Resume %s at %lld\n",
+				   conn->url, (long long)conn->written);
+	} else
+		release_connection(conn);
+
+	--outstanding;
+	sched_done(conn);
+	if (verbose)
+		printf("Retry %s in %.1f seconds (%d)\n",
+			   conn->url, delay, outstanding);
+	sched_retry(conn, delay);
 
 	return 0;
 }
+
+/* Reset connection - try again */
+int reset_connection(struct connection *conn)
+{
+	return retry_connection(conn, 0);
+}
 #endif
 
 static void add_link(struct connection *conn)
@@ -167,6 +366,8 @@ static void add_link(struct connection *conn)
 
 int start_one_comic(struct connection *conn)
 {
+	stats_start(conn);
+
 	if (links_only && !conn->regexp) {
 		add_link(conn);
 		conn->gotit = 1;
@@ -187,27 +388,20 @@ int start_one_comic(struct connection *conn)
 	}
 
 	printf("build_request %s failed\n", conn->url);
+	stats_fail(conn, "start");
 	if (debug_fp) {
 		time(&conn->access);
 		fprintf(debug_fp, "%ld: Start failed  %3d '%s' (%d)\n",
 				conn->access, conn->id,
 				conn->outname ? conn->outname : conn->url, outstanding);
 	}
+#ifndef WANT_CURL
+	if (conn->parent)
+		fail_segment_start(conn);
+#endif
 	return 0;
 }
 
-int start_next_comic(void)
-{
-	while (head && outstanding < thread_limit) {
-		int rc = start_one_comic(head);
-		head = head->next;
-		if (rc)
-			return rc;
-	}
-
-	return head != NULL;
-}
-
 void dump_outstanding(int sig)
 {
 	struct connection *conn;
@@ -259,6 +453,7 @@ static char *find_regexp(struct connection *conn, char *reg, int regsize)
 	regex_t regex;
 	regmatch_t match[MATCH_DEPTH];
 	int err, mn = conn->regmatch;
+	long offset;
 	/* Max line I have seen is 114k from comics.com! */
 	char buf[128 * 1024];
 
@@ -278,7 +473,7 @@ static char *find_regexp(struct connection *conn, char *reg, int regsize)
 		return NULL;
 	}
 
-	while (fgets(buf, sizeof(buf), fp)) {
+	while ((offset = ftell(fp)), fgets(buf, sizeof(buf), fp)) {
 		if (regexec(&regex, buf, MATCH_DEPTH, match, 0) == 0) {
 			/* got a match */
 			fclose(fp);
@@ -292,6 +487,7 @@ static char *find_regexp(struct connection *conn, char *reg, int regsize)
 				return NULL;
 			}
 
+			conn->stats.match = offset + match[mn].rm_so;
 			*(buf + match[mn].rm_eo) = '\0';
 			snprintf(reg, regsize, "%s", buf + match[mn].rm_so);
 			return reg;
@@ -304,6 +500,7 @@ static char *find_regexp(struct connection *conn, char *reg, int regsize)
 	fclose(fp);
 
 	printf("%s DID NOT MATCH REGEXP\n", conn->url);
+	stats_fail(conn, "no match");
 	if (verbose)
 		printf("  regexp '%s'\n", conn->regexp);
 	regfree(&regex);
@@ -315,14 +512,17 @@ int process_html(struct connection *conn)
 {
 	char imgurl[1024], regmatch[1024], *p;
 
-	if (conn->out >= 0) {
-		close(conn->out);
-		conn->out = -1;
-	}
+	if (commit_output(conn))
+		return 1;
+
+	update_validator(conn, conn->regfname);
+	conn->stats.bytes += conn->written;
+	conn->written = 0;
 
 	p = find_regexp(conn, regmatch, sizeof(regmatch));
 	if (p == NULL)
 		return 1;
+	stats_mark(&conn->stats.index);
 
 	/* imgurl just used as a tmp buffer */
 	p = fixup_url(regmatch, imgurl, sizeof(imgurl));
@@ -362,6 +562,9 @@ int process_html(struct connection *conn)
 		return 0;
 	}
 
+	if (sched_stage2(conn))
+		return 0;
+
 	if (build_request(conn) == 0)
 		set_writable(conn);
 	else
@@ -193,12 +193,47 @@ static void parse_top_str(char *key, char *val)
 		gocomics_url = must_strdup(val);
 	else if (strcmp(key, "gocomics-regexp") == 0)
 		gocomics_regexp = must_strdup(val);
-	else if (strcmp(key, "debug") == 0)
+	else if (strcmp(key, "state-dir") == 0) {
+		/* Do not override the command line option */
+		if (!state_dir)
+			set_state_dir(val);
+	} else if (strcmp(key, "debug") == 0)
 		debug_fp = fopen(val, "w");
 	else if (strcmp(key, "threads") == 0) {
 		if (!threads_set)
 			thread_limit = JSON_int(val);
-	} else if (strcmp(key, "timeout") == 0)
+	} else if (strcmp(key, "host-limit") == 0)
+		host_limit = JSON_int(val);
+	else if (strcmp(key, "index-limit") == 0)
+		index_limit = JSON_int(val);
+	else if (strcmp(key, "pace-ms") == 0)
+		pace_ms = JSON_int(val);
+	else if (strcmp(key, "early-data") == 0) {
+#if defined(WANT_CURL) || !defined(WANT_OPENSSL)
+		puts("Early data needs OpenSSL without curl");
+#else
+		early_data = JSON_int(val);
+#endif
+	} else if (strcmp(key, "hedge") == 0) {
+#ifdef WANT_CURL
+		puts("Hedged requests are not supported with curl");
+#else
+		hedge_budget = JSON_int(val);
+#endif
+	} else if (strcmp(key, "preconnect") == 0) {
+#ifdef WANT_CURL
+		puts("Pre-connects are not supported with curl");
+#else
+		want_preconnect = JSON_int(val);
+#endif
+	} else if (strcmp(key, "fastopen") == 0) {
+#ifdef WANT_CURL
+		puts("Fast open is not supported with curl");
+#else
+		want_fastopen = JSON_int(val);
+#endif
+	}
+	else if (strcmp(key, "timeout") == 0)
 		read_timeout = JSON_int(val);
 	else
 		printf("Unexpected element '%s'\n", key);
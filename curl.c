@@ -1,12 +1,115 @@
 #include "get-comics.h"
 #include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #define MAX_WAIT_MSECS (30 * 1000) /* Wait max. 30 seconds */
 
-#ifndef MULTI_THREADED
+#ifdef MULTI_THREADED
+/* A fixed pool of workers pulls comics off the queue. Each keeps its
+ * easy handle between comics, so curl's connection and DNS caches
+ * carry over within the thread. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Only the transfer runs unlocked. Starting, closing and failing a
+ * comic touch the validators, the store, the stats and the counts. */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread CURL *worker_curl;
+#else
 static CURLM *curlm;
+
+/* Idle easy handles. curl_easy_reset() keeps a handle's caches, so a
+ * recycled handle may still have a connection to the host. */
+#define MAX_IDLE	16
+static CURL *idle[MAX_IDLE];
+static int n_idle;
+#endif
+
+/* DNS, TLS sessions and, for the threads, connections are shared by
+ * all the easy handles. The multi handle already shares connections. */
+static CURLSH *share;
+
+#ifdef MULTI_THREADED
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock(CURL *curl, curl_lock_data data,
+					   curl_lock_access access, void *userptr)
+{
+	pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+	pthread_mutex_unlock(&share_locks[data]);
+}
+#endif
+
+/* Not fatal if this fails, it is only for performance */
+static void share_init(void)
+{
+	share = curl_share_init();
+	if (!share)
+		return;
+
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#ifdef MULTI_THREADED
+	int i;
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+		pthread_mutex_init(&share_locks[i], NULL);
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+#endif
+}
+
+/* Only after all the easy handles are gone */
+static void share_exit(void)
+{
+	if (share) {
+		curl_share_cleanup(share);
+		share = NULL;
+	}
+}
+
+static CURL *get_handle(void)
+{
+	CURL *curl;
+
+#ifdef MULTI_THREADED
+	curl = worker_curl;
+#else
+	curl = n_idle > 0 ? idle[--n_idle] : NULL;
+#endif
+	if (curl)
+		curl_easy_reset(curl);
+	else
+		curl = curl_easy_init();
+#ifdef MULTI_THREADED
+	worker_curl = curl;
 #endif
 
+	return curl;
+}
+
+static void put_handle(CURL *curl)
+{
+#ifdef MULTI_THREADED
+	/* The worker keeps it */
+	if (curl != worker_curl)
+		curl_easy_cleanup(curl);
+#else
+	curl_multi_remove_handle(curlm, curl);
+	if (n_idle < MAX_IDLE)
+		idle[n_idle++] = curl;
+	else
+		curl_easy_cleanup(curl);
+#endif
+}
+
 static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
 	struct connection *conn = userdata;
@@ -24,34 +127,84 @@ static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdat
 			fname = conn->outname;
 		}
 
-		if ((conn->out = creat(fname, 0644)) < 0) {
-			my_perror(fname);
+		if (open_output(conn, fname)) {
 			fail_connection(conn);
 			return bytes;
 		}
 
+		if (fname == conn->outname)
+			store_start(conn);
+
 		conn->connected = 1;
 	}
 
+	store_update(conn, ptr, bytes);
+
 	int n = write(conn->out, ptr, bytes);
 	if (n != bytes)
 		printf("Write error\n");
+	else
+		conn->written += n;
 
 	return n;
 }
 
+/* curl does the connect for us, so ask it how long things took */
+static void curl_stats(struct connection *conn, CURLcode res, int status)
+{
+	double connect, reply;
+
+	conn->stats.status = status;
+	if (!conn->stats.reply &&
+		curl_easy_getinfo(conn->curl, CURLINFO_CONNECT_TIME, &connect) == CURLE_OK &&
+		curl_easy_getinfo(conn->curl, CURLINFO_STARTTRANSFER_TIME, &reply) == CURLE_OK &&
+		reply > 0) {
+		conn->stats.connect = conn->stats.start + connect;
+		conn->stats.reply = conn->stats.start + reply;
+	}
+
+	if (res != CURLE_OK)
+		stats_fail(conn, curl_easy_strerror(res));
+	else if (status != 200)
+		stats_fail(conn, "status");
+}
+
 #ifdef MULTI_THREADED
-static void *comic_thread(void *arg)
+static struct connection *next_comic(void)
+{
+	struct connection *conn;
+
+	pthread_mutex_lock(&queue_lock);
+	conn = head;
+	if (conn)
+		head = conn->next;
+	pthread_mutex_unlock(&queue_lock);
+
+	return conn;
+}
+
+static void get_comic(struct connection *conn)
 {
-	struct connection *conn = arg;
 	int http_status_code;
+	CURLcode res;
 
-	start_one_comic(conn);
+	pthread_mutex_lock(&done_lock);
+	if (!start_one_comic(conn))
+		goto out;
 
 again:
-	curl_easy_perform(conn->curl);
+	pthread_mutex_unlock(&done_lock);
+	res = curl_easy_perform(conn->curl);
+	pthread_mutex_lock(&done_lock);
 
 	curl_easy_getinfo(conn->curl, CURLINFO_RESPONSE_CODE, &http_status_code);
+	curl_stats(conn, res, http_status_code);
+
+	if (res != CURLE_OK) {
+		printf("%s: %s\n", conn->url, curl_easy_strerror(res));
+		fail_connection(conn);
+		goto out;
+	}
 
 	if (http_status_code == 200) {
 		if (conn->regexp && !conn->matched) {
@@ -62,6 +215,24 @@ again:
 		} else
 			close_connection(conn);
 	} else {
+		printf("GET %s returned %d\n", conn->url, http_status_code);
+		fail_connection(conn);
+	}
+
+out:
+	pthread_mutex_unlock(&done_lock);
+}
+
+static void *worker(void *arg)
+{
+	struct connection *conn;
+
+	while ((conn = next_comic()))
+		get_comic(conn);
+
+	if (worker_curl) {
+		curl_easy_cleanup(worker_curl);
+		worker_curl = NULL;
 	}
 
 	return NULL;
@@ -69,25 +240,47 @@ again:
 
 void main_loop(void)
 {
-	struct connection *conn;
+	pthread_t *workers;
+	int i, n = thread_limit < n_comics ? thread_limit : n_comics;
 
-	thread_limit = n_comics;
+	/* Not thread safe, so do it before the workers */
+	if (curl_global_init(CURL_GLOBAL_DEFAULT)) {
+		printf("Unable to initialize curl\n");
+		exit(1);
+	}
+	share_init();
 
-	for (conn = comics; conn; conn = conn->next)
-		if (pthread_create(&conn->thread, NULL, comic_thread, conn))
+	workers = must_calloc(n, sizeof(pthread_t));
+	for (i = 0; i < n; ++i)
+		if (pthread_create(&workers[i], NULL, worker, NULL)) {
 			printf("Unable to create thread\n");
+			break;
+		}
 
-	for (conn = comics; conn; conn = conn->next)
-		pthread_join(conn->thread, NULL);
+	if (i == 0)
+		worker(NULL);
+	while (i-- > 0)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	share_exit();
 }
 #else
-static void msg_done(CURL *curl)
+static void msg_done(CURL *curl, CURLcode res)
 {
 	struct connection *conn;
 	int http_status_code;
 
 	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status_code);
 	curl_easy_getinfo(curl, CURLINFO_PRIVATE, &conn);
+	curl_stats(conn, res, http_status_code);
+
+	if (res != CURLE_OK) {
+		/* e.g. the transfer was cut short */
+		printf("%s: %s\n", conn->url, curl_easy_strerror(res));
+		fail_connection(conn);
+		return;
+	}
 
 	if (http_status_code == 200) {
 		if (conn->regexp && !conn->matched) {
@@ -101,45 +294,149 @@ static void msg_done(CURL *curl)
 	}
 }
 
+#ifdef __linux__
+/* curl tells us which sockets to watch and when its next timeout is,
+ * so a wakeup only costs the transfers that are ready. */
+#define MAX_EVENTS 64
+
+static int epfd = -1;
+static long curl_timeout = -1; /* -1 for none */
+
+static int socket_callback(CURL *curl, curl_socket_t sock, int what,
+						   void *userp, void *socketp)
+{
+	struct epoll_event ev;
+
+	if (what == CURL_POLL_REMOVE) {
+		/* Fails if curl already closed it, which is fine */
+		epoll_ctl(epfd, EPOLL_CTL_DEL, sock, NULL);
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	if (what & CURL_POLL_IN)
+		ev.events |= EPOLLIN;
+	if (what & CURL_POLL_OUT)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = sock;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &ev) &&
+		epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev)) {
+		my_perror("epoll_ctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int timer_callback(CURLM *multi, long timeout_ms, void *userp)
+{
+	curl_timeout = timeout_ms;
+	return 0;
+}
+
+static void events_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		my_perror("epoll_create1");
+		exit(1);
+	}
+
+	curl_multi_setopt(curlm, CURLMOPT_SOCKETFUNCTION, socket_callback);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, timer_callback);
+}
+
+static void wait_events(int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int i, n, mask, running;
+
+	if (curl_timeout >= 0 && curl_timeout < timeout)
+		timeout = curl_timeout;
+
+	n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+	if (n < 0 && errno != EINTR)
+		my_perror("epoll_wait");
+
+	/* curl handles any expired timers on every call */
+	if (n <= 0) {
+		curl_multi_socket_action(curlm, CURL_SOCKET_TIMEOUT, 0, &running);
+		return;
+	}
+
+	for (i = 0; i < n; ++i) {
+		mask = 0;
+		if (events[i].events & EPOLLIN)
+			mask |= CURL_CSELECT_IN;
+		if (events[i].events & EPOLLOUT)
+			mask |= CURL_CSELECT_OUT;
+		if (events[i].events & (EPOLLERR | EPOLLHUP))
+			mask |= CURL_CSELECT_ERR;
+		curl_multi_socket_action(curlm, events[i].data.fd, mask, &running);
+	}
+}
+
+static void events_exit(void)
+{
+	close(epfd);
+	epfd = -1;
+}
+#else
+static void events_init(void) {}
+static void events_exit(void) {}
+
+static void wait_events(int timeout)
+{
+	int numfds = 0, running;
+
+	curl_multi_wait(curlm, NULL, 0, timeout, &numfds);
+	curl_multi_perform(curlm, &running);
+}
+#endif
+
 void main_loop(void)
 {
-	int i, running, msgs_left;
+	int i, msgs_left;
 	CURLMsg *msg;
 
 	if (curl_global_init(CURL_GLOBAL_DEFAULT) || !(curlm = curl_multi_init())) {
 		printf("Unable to initialize curl\n");
 		exit(1);
 	}
+	share_init();
+	events_init();
 
 	/* Setup for the first comics */
 	for (i = 0; i < thread_limit; ++i)
 		start_next_comic();
 
-	curl_multi_perform(curlm, &running);
-
 	while (start_next_comic() || outstanding) {
-		int numfds=0;
-
-		curl_multi_wait(curlm, NULL, 0, MAX_WAIT_MSECS, &numfds);
-
-		curl_multi_perform(curlm, &running);
+		wait_events(sched_timeout(MAX_WAIT_MSECS));
 
 		while ((msg = curl_multi_info_read(curlm, &msgs_left)))
 			if (msg->msg == CURLMSG_DONE)
-				msg_done(msg->easy_handle);
+				msg_done(msg->easy_handle, msg->data.result);
 	}
 
+	while (n_idle > 0)
+		curl_easy_cleanup(idle[--n_idle]);
 	curl_multi_cleanup(curlm);
+	events_exit();
+	share_exit();
 }
 #endif
 
 int build_request(struct connection *conn)
 {
-	if (!(conn->curl = curl_easy_init())) {
+	if (!(conn->curl = get_handle())) {
 		printf("Unable to create curl context\n");
 		return -1;
 	}
 
+	if (share)
+		curl_easy_setopt(conn->curl, CURLOPT_SHARE, share);
+
 	if (conn->insecure && is_https(conn->url)) {
 		/* Skip peer validation and hostname validate. Less secure,
 		 * but we are getting comics.
@@ -149,6 +446,9 @@ int build_request(struct connection *conn)
 	}
 
 	curl_easy_setopt(conn->curl, CURLOPT_URL, conn->url);
+	if (*method == 'H')
+		/* link-check */
+		curl_easy_setopt(conn->curl, CURLOPT_NOBODY, 1L);
 	curl_easy_setopt(conn->curl, CURLOPT_FOLLOWLOCATION, 1L);
 	curl_easy_setopt(conn->curl, CURLOPT_PRIVATE, conn);
 	curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, write_callback);
@@ -180,17 +480,11 @@ int build_request(struct connection *conn)
 int release_connection(struct connection *conn)
 {
 	if (conn->curl) {
-#ifndef MULTI_THREADED
-		curl_multi_remove_handle(curlm, conn->curl);
-#endif
-		curl_easy_cleanup(conn->curl);
+		put_handle(conn->curl);
 		conn->curl = NULL;
 	}
 
-	if (conn->out >= 0) {
-		close(conn->out);
-		conn->out = -1;
-	}
+	discard_output(conn);
 
 	conn->connected = 0;
 
@@ -199,6 +493,17 @@ int release_connection(struct connection *conn)
 
 void free_cache(void) {}
 
+int add_source(const char *addr)
+{
+	puts("Source addresses are not supported with curl");
+	return 1;
+}
+
+void run_reactors(void)
+{
+	main_loop();
+}
+
 char *fixup_url(char *url, char *tmp, int len)
 {   /* curl deals with this */
 	return url;
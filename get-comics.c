@@ -51,6 +51,8 @@ static void free_comics(void)
 		free(comics->outname);
 		free(comics->base_href);
 		free(comics->referer);
+		free(comics->etag);
+		free(comics->lastmod);
 
 		free(comics);
 		comics = next;
@@ -70,7 +72,7 @@ static void clean_dir(void)
 	while ((ent = readdir(dir))) {
 		if (*ent->d_name == '.') continue;
 		char *p = strrchr(ent->d_name, '.');
-		if (p && is_imgtype(p))
+		if (p && (is_imgtype(p) || strcmp(p, TMP_EXT) == 0))
 			unlink(ent->d_name);
 		else
 			printf("Warning: %s\n", ent->d_name);
@@ -111,12 +113,17 @@ static void cd_comics_dir(int clean)
 
 static void usage(int rc)
 {
-	fputs("usage:  get-comics [-hckvCV] [-d comics_dir]", stdout);
+	fputs("usage:  get-comics [-hcfkoqvCV] [-d comics_dir]", stdout);
 	puts(" [-i index_dir] [-l links_file]");
-	puts("                   [-t threads] [-T timeout] [config-file ...]");
+	puts("                   [-s state_dir] [-t threads] [-T timeout]"
+		 " [config-file ...]");
 	puts("Where:  -h  this help");
 	puts("\t-c  clean (remove) images from comics dir before downloading");
+	puts("\t-f  flush (sync) the comics to disk when done");
 	puts("\t-k  keep index files");
+	puts("\t-o  start comics in config order, not longest first");
+	puts("\t-q  show statistics from the state dir and exit");
+	puts("\t-s  keep state between runs (e.g. for conditional GETs)");
 	puts("\t-v  verbose");
 	puts("\t-V  verify config but don't download comics");
 	exit(rc);
@@ -124,9 +131,9 @@ static void usage(int rc)
 
 int main(int argc, char *argv[])
 {
-	int i, verify = 0, clean = 0;
+	int i, verify = 0, clean = 0, want_sync = 0, query = 0, config_order = 0;
 
-	while ((i = getopt(argc, argv, "cd:hi:kl:t:vT:V")) != -1)
+	while ((i = getopt(argc, argv, "cd:fhi:kl:oqs:t:vT:V")) != -1)
 		switch ((char)i) {
 		case 'c':
 			clean = 1;
@@ -134,6 +141,9 @@ int main(int argc, char *argv[])
 		case 'd':
 			comics_dir = must_strdup(optarg);
 			break;
+		case 'f':
+			want_sync = 1;
+			break;
 		case 'h':
 			usage(0);
 		case 'i':
@@ -149,6 +159,15 @@ int main(int argc, char *argv[])
 				exit(1);
 			}
 			break;
+		case 'o':
+			config_order = 1;
+			break;
+		case 'q':
+			query = 1;
+			break;
+		case 's':
+			set_state_dir(optarg);
+			break;
 		case 't':
 			thread_limit = strtol(optarg, NULL, 0);
 			threads_set = 1;
@@ -166,6 +185,10 @@ int main(int argc, char *argv[])
 			usage(1);
 		}
 
+	if (query && state_dir)
+		/* No need for a config file */
+		return stats_query(STATS_DAYS);
+
 	if (optind < argc)
 		while (optind < argc) {
 			if (read_config(argv[optind])) {
@@ -179,6 +202,9 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (query)
+		return stats_query(STATS_DAYS);
+
 	if (verify) {
 		printf("Comics: %u Skipped today: %u\n", n_comics + skipped, skipped);
 		if (verbose)
@@ -191,8 +217,9 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (thread_limit > n_comics)
-		thread_limit = n_comics;
+	/* Hedges and pre-connects need connections too */
+	if (thread_limit > n_comics * (want_preconnect ? 2 : 1) + max_hedges())
+		thread_limit = n_comics * (want_preconnect ? 2 : 1) + max_hedges();
 
 	cd_comics_dir(clean);
 
@@ -205,7 +232,15 @@ int main(int argc, char *argv[])
 #endif
 
 	want_extensions = 1;
+	state_init();
+	stats_init();
+	if (!config_order)
+		stats_order();
 	main_loop();
+	stats_save();
+	state_exit();
+	if (want_sync)
+		sync_outputs();
 
 	out_results(comics, skipped);
 #ifdef WIN32
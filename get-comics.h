@@ -22,11 +22,22 @@
 
 #ifdef WANT_GZIP
 #include <zlib.h>
+#ifdef WANT_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #else
 #define z_stream void
 static inline int inflateEnd(void *strm) { return -1; }
 #endif
 
+#ifdef WANT_BROTLI
+#include <brotli/decode.h>
+#endif
+
+#ifdef WANT_ZSTD
+#include <zstd.h>
+#endif
+
 #ifdef WANT_CURL
 #include <curl/curl.h>
 #endif
@@ -35,6 +46,11 @@ static inline int inflateEnd(void *strm) { return -1; }
 
 /* Limit the number of concurrent sockets. */
 #define THREAD_LIMIT	100
+/* Limit the number of concurrent sockets per host. */
+#define HOST_LIMIT		6
+
+/* How far back get-comics -q looks, in days */
+#define STATS_DAYS		30
 
 /*
  * Maximum length of time to wait for a read/write
@@ -42,6 +58,13 @@ static inline int inflateEnd(void *strm) { return -1; }
  */
 #define SOCKET_TIMEOUT	(2 * 60)
 
+/* Failed requests go back on the queue. The first retry is after about
+ * RETRY_MS, doubling each time. We give up if the server asks us to
+ * wait more than RETRY_MAX seconds. */
+#define MAX_RETRIES		3
+#define RETRY_MS		500
+#define RETRY_MAX		60
+
 /* The depth of the regexp matchs. */
 /* Affects the maximum value of the <regmatch> tag */
 #define MATCH_DEPTH		4
@@ -54,6 +77,13 @@ static inline int inflateEnd(void *strm) { return -1; }
  */
 #define BUFSIZE		(64 * 1024)
 
+/* Buffers start out small and grow on demand up to BUFSIZE. Most
+ * connections never need more. build_request grows the buffer first
+ * if the request will not fit, so only a request bigger than BUFSIZE
+ * fails.
+ */
+#define MIN_BUFSIZE	(4 * 1024)
+
 struct log {
 	char **events;
 	int n_events;
@@ -62,6 +92,31 @@ struct log {
 };
 
 
+/* See state.c */
+struct validator {
+	char *url;
+	char *etag;
+	char *lastmod;
+	char *fname;
+	uint64_t hash;
+	time_t seen;
+	struct validator *next;
+};
+
+/* See stats.c. Times are from now(). */
+struct stats {
+	double start;
+	double connect;
+	double reply;
+	double index;
+	double done;
+	off_t bytes;
+	long match;
+	int status;
+	const char *reason;
+	char *index_host; /* the config url's host */
+};
+
 struct connection {
 	int id; /* for debugging */
 	int out;
@@ -72,6 +127,8 @@ struct connection {
 	int   regmatch;
 	int   matched;
 	char *outname;
+	char *tmpname; /* output is written here until complete */
+	off_t written; /* bytes in tmpname, for resume */
 	char *base_href;
 	char *referer; /* king features needs this */
 	unsigned days; /* bitmask */
@@ -83,20 +140,48 @@ struct connection {
 	int connected;
 	time_t access;
 
+	/* for conditional GETs */
+	struct validator *validator;
+	char *etag;
+	char *lastmod;
+
+	/* for the store */
+	uint64_t hash;
+	int hashing;
+
+	struct sched_host *shost; /* for sched.c */
+	double retry_at;
+	int stage1; /* counted as an index fetch */
+
+	/* for hedged requests, see hedge.c */
+	struct connection *hedge; /* the duplicate, or the original */
+	int is_hedge;
+	int hedged;
+
+	/* for pre-connects, see preconnect.c */
+	struct connection *warm; /* the pre-connect, or its owner */
+	int is_warm;
+	struct stats stats;
+
 #ifdef WANT_CURL
 	CURL *curl;
-#ifdef MULTI_THREADED
-	pthread_t thread;
-#endif
 #else
 	struct pollfd *poll;
 	char *buf;
+	int  bufsize;
+	int  grow; /* grow buffer on next reset */
 	char *curp; /* for chunking */
 	char *endp; /* for chunking */
+	const struct decoder *decoder; /* Content-Encoding */
 	z_stream *zs; /* for gzip */
-	unsigned char *zs_buf; /* for gzip */
+	void *dstate; /* for brotli and zstd */
+#ifdef WANT_LIBDEFLATE
+	unsigned char *zbody; /* for one shot gzip */
+	int  zlen;
+#endif
 	int  length; /* content length if available */
 	int  rlen;
+	struct tfo_host *tfo; /* fast open, see socket.c */
 	enum {
 		CS_NONE,
 		CS_START_CR,
@@ -108,8 +193,23 @@ struct connection {
 	int (*func)(struct connection *conn);
 #define NEXT_STATE(c, f)  ((c)->func = (f))
 
+	/* for segmented downloads, see segment.c */
+	struct connection *parent;
+	off_t range_start;
+	off_t range_end; /* inclusive, 0 for no range */
+	off_t offset; /* where the next segment byte goes */
+	off_t total; /* from Content-Range */
+	int pending; /* segments or a hedge outstanding */
+	int failed; /* a segment failed */
+	double started;
+
+	int claim; /* for multi-reactor mode, see reactor.c */
+
 #ifdef WANT_SSL
 	void *ssl;
+	int early; /* 0-RTT state, see openssl.c. -1 for never. */
+	int early_sent; /* requests sent as 0-RTT on this socket */
+	int early_accepted; /* and accepted, printed on close with -v */
 #endif
 #endif /* WANT_CURL */
 
@@ -146,11 +246,23 @@ extern int gotit;
 extern int resets;
 
 extern const char *method;
+extern char *state_dir;
+extern int max_segments;
+extern int host_limit;
+extern int index_limit;
+extern int pace_ms;
+extern int hedge_budget;
+extern int early_data;
+extern int want_preconnect;
+extern int want_fastopen;
+extern int reactors;
 
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 #define WRITE_FLAGS (O_CREAT | O_TRUNC | O_WRONLY | O_BINARY)
+#define TMP_EXT ".part"
+#define HEDGE_EXT ".hedge"
 
 #ifndef _WIN32
 #define closesocket close
@@ -184,11 +296,16 @@ static inline void my_perror(const char *str)
 #define perror(s)	Do_not_use_perror
 
 int reset_connection(struct connection *conn);
+int retry_connection(struct connection *conn, int secs);
 int fail_connection(struct connection *conn);
 int release_connection(struct connection *conn);
 int close_connection(struct connection *conn);
 int process_html(struct connection *conn);
 void do_add_regexp(struct connection *conn, const char *regexp, const char *index_dir);
+int open_output(struct connection *conn, const char *fname);
+int commit_output(struct connection *conn);
+void discard_output(struct connection *conn);
+void sync_outputs(void);
 
 #ifdef WANT_CURL
 static inline void set_writable(struct connection *conn) {}
@@ -207,6 +324,7 @@ int set_conn_socket(struct connection *conn, int sock);
 #endif
 
 char *must_strdup(const char *str);
+double now(void);
 void *must_calloc(int nmemb, int size);
 static inline void *must_alloc(int size) { return must_calloc(1, size); }
 char *lazy_imgtype(char *buf);
@@ -220,16 +338,87 @@ int read_config(const char *fname);
 void add_index_dir(const char *dir);
 void clean_index_dir(void);
 
+/* export from state.c */
+void set_state_dir(const char *dir);
+char *state_path(const char *name, char *path, int len);
+void state_init(void);
+void state_exit(void);
+struct validator *find_validator(struct connection *conn, const char *fname);
+void update_validator(struct connection *conn, const char *fname);
+
+/* export from store.c */
+void store_init(void);
+void store_exit(void);
+void store_start(struct connection *conn);
+void store_update(struct connection *conn, const void *buf, int len);
+void store_finish(struct connection *conn);
+int store_has(uint64_t hash, const char *fname);
+int store_link(uint64_t hash, const char *fname);
+
 /* export from http.c */
 void write_request(struct connection *conn);
 int read_reply(struct connection *conn);
 int build_request(struct connection *conn);
 void out_results(struct connection *comics, int skipped);
 
+/* export from stats.c */
+void stats_init(void);
+void stats_start(struct connection *conn);
+void stats_mark(double *when);
+void stats_fail(struct connection *conn, const char *reason);
+void stats_save(void);
+void stats_order(void);
+const char *stats_last_host(struct connection *conn);
+long stats_percentile(const char *host, int pct);
+int stats_query(int days);
+
+/* export from sched.c */
+int start_next_comic(void);
+int sched_timeout(int timeout);
+void sched_done(struct connection *conn);
+void sched_loss(void);
+void sched_queue(struct connection *conn);
+void sched_requeue(void);
+void sched_retry(struct connection *conn, double delay);
+int sched_stage2(struct connection *conn);
+void sched_hedge(void);
+int max_hedges(void);
+
+/* export from segment.c */
+int want_segments(struct connection *conn);
+void segment_request(struct connection *conn);
+int split_connection(struct connection *conn);
+int close_segment(struct connection *conn, int ok);
+void fail_segment_start(struct connection *conn);
+int write_segment(struct connection *conn, char *buf, int bytes);
+
+/* export from hedge.c */
+int want_hedge(struct connection *conn);
+struct connection *start_hedge(struct connection *conn);
+struct connection *hedge_won(struct connection *conn);
+int hedge_lost(struct connection *conn);
+
+/* export from preconnect.c */
+int predict_host(struct connection *conn, char *host, int len);
+struct connection *start_preconnect(struct connection *conn, const char *host);
+int take_preconnect(struct connection *conn);
+void drop_preconnect(struct connection *warm);
+
+/* export from reactor.c */
+int reactor_claim(struct connection *conn);
+void run_reactors(void);
+
 /* export from socket.c */
 int connect_socket(struct connection *conn, char *hostname, char *port);
 void check_connect(struct connection *conn);
 void free_cache(void);
+void fastopen_check(struct connection *conn);
+void fastopen_exit(void);
+int add_source(const char *addr);
+int sources_shared(void);
+void sources_share(int *counts);
+void sources_merge(const int *counts);
+void sources_exit(void);
 
 /* export from openssl.c */
 int openssl_connect(struct connection *conn);
@@ -237,9 +426,9 @@ int openssl_check_connect(struct connection *conn);
 int openssl_read(struct connection *conn);
 int openssl_write(struct connection *conn);
 void openssl_close(struct connection *conn);
+void openssl_exit(void);
 
 /* export from get-comics.c */
-int start_next_comic(void);
 int start_one_comic(struct connection *conn);
 
 void main_loop(void);
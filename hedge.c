@@ -0,0 +1,182 @@
+#include "get-comics.h"
+#include <limits.h>
+
+/* Hedged requests (the hedge config key).
+ *
+ * When a transfer runs long, sched_hedge() starts a duplicate of it on
+ * a new connection. The duplicate writes to fname.hedge.part. Whichever
+ * finishes first wins and the other is released. If the duplicate
+ * wins, its output is renamed over the original's and the original is
+ * closed as if it had done the work, so validators, the store and
+ * stats all see one comic.
+ *
+ * If the original fails first it gives up its socket and waits for the
+ * duplicate (pending = 1). A duplicate that fails just goes away.
+ */
+
+#ifndef _WIN32
+int want_hedge(struct connection *conn)
+{
+	return conn->poll && *method == 'G' && !conn->hedged && !conn->is_hedge &&
+		!conn->parent && !conn->pending && !conn->range_end &&
+		(!conn->regexp || conn->matched) && conn->outname;
+}
+
+static void free_hedge(struct connection *dup)
+{
+	free(dup->url);
+	free(dup->host);
+	free(dup->outname);
+	free(dup->referer);
+	free(dup);
+}
+
+/* Start a duplicate of conn. Returns NULL if we could not. */
+struct connection *start_hedge(struct connection *conn)
+{
+	struct connection *dup = must_alloc(sizeof(struct connection));
+	char *p;
+
+	conn->hedged = 1; /* only once, even if we fail */
+
+	dup->out = -1;
+	dup->id = conn->id;
+	dup->gotit = 1; /* not a comic, keep out of out_results */
+	dup->is_hedge = 1;
+	dup->url = must_strdup(conn->url);
+	dup->host = must_strdup(conn->host);
+	if (conn->referer)
+		dup->referer = must_strdup(conn->referer);
+	dup->redirect_ok = conn->redirect_ok;
+	dup->insecure = conn->insecure;
+
+	/* Room for the extension, which the original may already have */
+	dup->outname = must_alloc(strlen(conn->outname) + 4 + 1);
+	strcpy(dup->outname, conn->outname);
+	p = strrchr(dup->outname, '.');
+	if (want_extensions && p && is_imgtype(p))
+		*p = '\0';
+
+	if (build_request(dup)) {
+		release_connection(dup);
+		free_hedge(dup);
+		return NULL;
+	}
+
+	dup->hedge = conn;
+	conn->hedge = dup;
+	dup->next = conn->next;
+	conn->next = dup;
+
+	time(&dup->access);
+	++outstanding;
+	if (verbose)
+		printf("Hedge %s (%d)\n", conn->url, outstanding);
+
+	return dup;
+}
+
+static void cancel_hedge(struct connection *conn)
+{
+	conn->hedge = NULL;
+	--outstanding;
+	sched_done(conn);
+	if (verbose > 1)
+		printf("Cancel %s%s (%d)\n",
+		       conn->is_hedge ? "hedge " : "", conn->url, outstanding);
+	release_connection(conn);
+}
+
+/* conn finished first. Returns the original for close_connection to
+ * finish, or NULL if there is nothing more to do. */
+struct connection *hedge_won(struct connection *conn)
+{
+	struct connection *orig, *dup;
+	char tmpname[PATH_MAX];
+
+	if (!conn->is_hedge) {
+		cancel_hedge(conn->hedge);
+		conn->hedge = NULL;
+		return conn;
+	}
+
+	dup = conn;
+	orig = dup->hedge;
+	orig->hedge = NULL;
+
+	if (dup->out >= 0 && close(dup->out)) {
+		my_perror(dup->tmpname);
+		dup->out = -1;
+		goto failed;
+	}
+	dup->out = -1;
+
+	snprintf(tmpname, sizeof(tmpname), "%s" TMP_EXT, dup->outname);
+	if (!dup->tmpname || rename(dup->tmpname, tmpname)) {
+		my_perror(tmpname);
+		goto failed;
+	}
+	free(dup->tmpname);
+	dup->tmpname = NULL;
+
+	/* Drop whatever the original had and take the duplicate's */
+	if (orig->out >= 0) {
+		close(orig->out);
+		orig->out = -1;
+	}
+	if (orig->tmpname && strcmp(orig->tmpname, tmpname))
+		unlink(orig->tmpname);
+	free(orig->tmpname);
+	orig->tmpname = must_strdup(tmpname);
+	strcpy(orig->outname, dup->outname);
+	orig->written = dup->written;
+	orig->hash = dup->hash;
+	orig->hashing = dup->hashing;
+	free(orig->etag);
+	free(orig->lastmod);
+	orig->etag = dup->etag;
+	orig->lastmod = dup->lastmod;
+	dup->etag = dup->lastmod = NULL;
+	orig->stats.status = dup->stats.status;
+
+	if (verbose)
+		printf("Hedge won %s\n", orig->url);
+	dup->written = 0; /* the bytes are the original's now */
+	cancel_hedge(dup);
+	return orig;
+
+failed:
+	if (orig->pending) {
+		cancel_hedge(dup);
+		fail_connection(orig);
+	} else
+		cancel_hedge(dup); /* the original carries on */
+	return NULL;
+}
+
+/* conn failed. Returns 1 if the other one carries on. */
+int hedge_lost(struct connection *conn)
+{
+	struct connection *orig = conn->is_hedge ? conn->hedge : conn;
+
+	if (conn->is_hedge) {
+		cancel_hedge(conn);
+		orig->hedge = NULL;
+		if (orig->pending) /* both failed */
+			fail_connection(orig);
+		return 1;
+	}
+
+	/* The original failed. Wait for the duplicate. */
+	if (verbose > 1)
+		printf("Waiting on hedge %s\n", conn->url);
+	release_connection(conn);
+	conn->pending = 1;
+	return 1;
+}
+#else
+int want_hedge(struct connection *conn) { return 0; }
+struct connection *start_hedge(struct connection *conn) { return NULL; }
+struct connection *hedge_won(struct connection *conn) { return conn; }
+int hedge_lost(struct connection *conn) { return 0; }
+#endif
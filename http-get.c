@@ -109,9 +109,11 @@ static int read_link_file(char *fname)
 
 static void usage(int rc)
 {
-	fputs("usage: http-get [-v] [-t threads]", stdout);
-	puts(" [-T timeout] [link_file ...]");
+	fputs("usage: http-get [-v] [-j reactors] [-s state_dir] [-t threads]", stdout);
+	puts(" [-S segments] [-T timeout] [link_file ...]");
 	puts("\nIf no link_files are specified, read urls from stdin.");
+	puts("-S splits large downloads into up to that many range requests.");
+	puts("-j runs that many event loops in separate processes.");
 	exit(rc);
 }
 
@@ -120,10 +122,17 @@ int main(int argc, char *argv[])
 {
 	int i;
 
-	while ((i = getopt(argc, argv, "hl:r:R:t:uUvT:")) != -1)
+	while ((i = getopt(argc, argv, "hj:l:r:R:s:S:t:uUvT:")) != -1)
 		switch ((char)i) {
 		case 'h':
 			usage(0);
+		case 'j':
+#ifdef WANT_CURL
+			puts("Reactors are not supported with curl");
+#else
+			reactors = strtol(optarg, NULL, 0);
+#endif
+			break;
 		case 'l':
 			read_link_file(optarg);
 			break;
@@ -135,6 +144,16 @@ int main(int argc, char *argv[])
 			if (regmatch >= MATCH_DEPTH)
 				printf("-R %d >= %d.\n", regmatch, MATCH_DEPTH);
 			break;
+		case 's':
+			set_state_dir(optarg);
+			break;
+		case 'S':
+#ifdef WANT_CURL
+			puts("Segmented downloads are not supported with curl");
+#else
+			max_segments = strtol(optarg, NULL, 0);
+#endif
+			break;
 		case 't':
 			thread_limit = strtol(optarg, NULL, 0);
 			break;
@@ -162,14 +181,23 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (thread_limit > n_comics)
-		thread_limit = n_comics;
+	/* Each segment needs a connection */
+	if (thread_limit > n_comics * (max_segments ? max_segments : 1))
+		thread_limit = n_comics * (max_segments ? max_segments : 1);
 
 #ifdef _WIN32
 	win32_init();
 #endif
 
-	main_loop();
+	if (reactors > 1 && state_dir) {
+		/* Each would write the state file */
+		printf("-j cannot be used with -s\n");
+		exit(1);
+	}
+
+	state_init();
+	run_reactors();
+	state_exit();
 
 	out_results(comics, 0);
 
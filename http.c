@@ -1,4 +1,6 @@
+#define _GNU_SOURCE /* for strptime */
 #include "get-comics.h"
+#include <limits.h>
 
 /*
  * Known limitations:
@@ -24,20 +26,77 @@ static char *http = "HTTP/1.1";
 static int read_file(struct connection *conn);
 static int read_file_unsized(struct connection *conn);
 static int read_file_chunked(struct connection *conn);
-static int gzip_init(struct connection *conn);
-static int read_file_gzip(struct connection *conn);
-static int write_output_gzipped(struct connection *conn, size_t bytes);
-static void gzip_free(struct connection *conn);
+static int read_file_decoded(struct connection *conn);
+static int decoder_init(struct connection *conn, const char *encoding);
+static void decoder_free(struct connection *conn);
+static void decoder_free_pools(void);
+static const char *accept_encoding(void);
+static int oneshot_init(struct connection *conn);
+static int read_file_oneshot(struct connection *conn);
+
+/* Content-Encoding decoders. The write functions return < 0 on error,
+ * 1 at the end of the stream, else 0. This matches zlib.
+ */
+struct decoder {
+	const char *name;
+	int (*init)(struct connection *conn);
+	int (*write)(struct connection *conn, char *in, size_t bytes);
+	void (*free)(struct connection *conn);
+};
+
+/* Maximum number of idle buffers to keep around. Anything over this
+ * high water mark is freed.
+ */
+#define MAX_FREE_BUFS	16
 
 static struct buflist {
 	struct buflist *next; /* must be first */
 	char *buf;
+	int size;
 } *freelist;
+static int n_free;
+
+#if defined(WANT_GZIP) || defined(WANT_BROTLI) || defined(WANT_ZSTD)
+/* Only one connection is decoding at a time. */
+static unsigned char dec_buf[BUFSIZE];
+#endif
+
+/* Double the buffer, keeping any unread data. */
+static int grow_buf(struct connection *conn)
+{
+	char *buf;
+	int size = conn->bufsize * 2;
+
+	if (conn->bufsize >= BUFSIZE)
+		return 1;
+	if (size > BUFSIZE)
+		size = BUFSIZE;
+
+	buf = realloc(conn->buf, size + 1);
+	if (!buf)
+		return 1;
+
+	if (verbose > 1)
+		printf("Grow buffer %d -> %d\n", conn->bufsize, size);
+
+	conn->curp = buf + (conn->curp - conn->buf);
+	conn->endp = buf + (conn->endp - conn->buf);
+	conn->rlen += size - conn->bufsize;
+	conn->buf = buf;
+	conn->bufsize = size;
+	return 0;
+}
 
 static inline void reset_buf(struct connection *conn)
 {
+	if (conn->grow) {
+		/* The last read filled the buffer */
+		conn->grow = 0;
+		conn->curp = conn->endp = conn->buf;
+		grow_buf(conn);
+	}
 	conn->curp = conn->buf;
-	conn->rlen = BUFSIZE;
+	conn->rlen = conn->bufsize;
 }
 
 static char *get_buf(struct connection *conn)
@@ -45,10 +104,16 @@ static char *get_buf(struct connection *conn)
 	if (!conn->buf) {
 		if (freelist) {
 			conn->buf = freelist->buf;
+			conn->bufsize = freelist->size;
 			freelist = freelist->next;
+			--n_free;
+		} else {
+			conn->buf = malloc(MIN_BUFSIZE + 1);
+			conn->bufsize = MIN_BUFSIZE;
+		}
+		conn->grow = 0;
+		if (conn->buf)
 			reset_buf(conn);
-		} else
-			conn->buf = malloc(BUFSIZE + 1);
 	}
 	return conn->buf;
 }
@@ -60,18 +125,36 @@ static void free_buf(struct connection *conn)
 	if (!conn->buf)
 		return;
 
+	if (n_free >= MAX_FREE_BUFS) {
+		free(conn->buf);
+		conn->buf = NULL;
+		return;
+	}
+
 	b = (struct buflist *)conn->buf;
 	b->buf = conn->buf;
+	b->size = conn->bufsize;
 	conn->buf = NULL;
 	b->next = freelist;
 	freelist = b;
+	++n_free;
+}
+
+static void free_freelist(void)
+{
+	while (freelist) {
+		struct buflist *next = freelist->next;
+		free(freelist->buf);
+		freelist = next;
+	}
+	n_free = 0;
 }
 
 
 static int do_process_html(struct connection *conn)
 {
 	/* for reused sockets we must close any gzip connection */
-	gzip_free(conn);
+	decoder_free(conn);
 	return process_html(conn);
 }
 
@@ -91,16 +174,15 @@ int release_connection(struct connection *conn)
 	}
 	conn->poll = NULL;
 
-	if (conn->out >= 0) {
-		close(conn->out);
-		conn->out = -1;
-	}
+	discard_output(conn);
 
 	conn->func = NULL;
 
 	conn->connected = 0;
+	conn->pending = 0;
+	conn->tfo = NULL;
 
-	gzip_free(conn);
+	decoder_free(conn);
 
 	free_buf(conn);
 
@@ -113,8 +195,11 @@ static int fail_redirect(struct connection *conn)
 {
 	if (conn->poll)
 		printf("Failed redirect not closed: %s\n", conn->url);
+	else if (conn->hedge && hedge_lost(conn))
+		return 0;
 	else {
 		--outstanding;
+		sched_done(conn);
 		if (verbose > 1)
 			printf("Failed redirect %s (%d)\n",
 			       conn->url, outstanding);
@@ -140,7 +225,7 @@ static void safecat(char *dst, const char *src, int dstsize)
 	}
 }
 
-#define SAFECAT(str) safecat(conn->buf, str, BUFSIZE)
+#define SAFECAT(str) safecat(conn->buf, str, conn->bufsize)
 
 static void add_full_header(struct connection *conn, const char *host)
 {
@@ -162,15 +247,37 @@ static void add_full_header(struct connection *conn, const char *host)
 			"Accept-Charset: ISO-8859-1,utf-8;q=0.7,*;q=0.7\r\n");
 #endif
 
-#ifdef WANT_GZIP
-	SAFECAT("Accept-Encoding: gzip, deflate\r\n");
-#endif
+	/* A range of an encoded body is no use to us */
+	if (*accept_encoding() && !conn->tmpname && !want_segments(conn)) {
+		SAFECAT("Accept-Encoding: ");
+		SAFECAT(accept_encoding());
+		SAFECAT("\r\n");
+	}
 
 #ifdef FULL_HEADER
 	SAFECAT("Connection: keep-alive\r\n");
 #endif
 }
 
+/* An upper bound on the request built below. The url may grow by
+ * three for spaces; the other headers are limited by their formats. */
+static int request_size(struct connection *conn, const char *host,
+						const char *url)
+{
+	int size = strlen(method) + strlen(url) * 3 + strlen(http) + 8;
+
+	size += strlen(host) + strlen(user_agent) + strlen(accept_encoding()) + 64;
+#ifdef FULL_HEADER
+	size += 300;
+#endif
+	if (conn->referer)
+		size += 216;
+	/* Range and If-Range, or If-None-Match and If-Modified-Since */
+	size += 64 + 2 * 216;
+
+	return size;
+}
+
 static int open_socket(struct connection *conn, char *host)
 {
 	char *port, *p;
@@ -263,7 +370,19 @@ int build_request(struct connection *conn)
 		return 1;
 	}
 
-	if (!CONN_OPEN)
+	conn->curp = conn->endp = conn->buf;
+	while (conn->bufsize < request_size(conn, host, url))
+		if (grow_buf(conn)) {
+			printf("Request too long for %s\n", conn->url);
+			free(host);
+			free_buf(conn);
+			return 1;
+		}
+
+	/* No request yet, in case the connect finishes at once */
+	conn->length = 0;
+
+	if (!CONN_OPEN && !take_preconnect(conn))
 		if (open_socket(conn, host)) {
 			printf("Connection failed to %s\n", host);
 			free(host);
@@ -286,7 +405,7 @@ int build_request(struct connection *conn)
 				*out++ = *in++;
 		sprintf(out, " %s\r\n", http);
 	} else
-		snprintf(conn->buf, BUFSIZE, "%s %s %s\r\n", method, url, http);
+		snprintf(conn->buf, conn->bufsize, "%s %s %s\r\n", method, url, http);
 
 	add_full_header(conn, host);
 
@@ -299,6 +418,32 @@ int build_request(struct connection *conn)
 		sprintf(conn->buf + strlen(conn->buf),
 			"Referer: %.200s\r\n", conn->referer);
 
+	if (conn->tmpname) {
+		/* Resume. If the file changed we get a 200 and start over. */
+		sprintf(conn->buf + strlen(conn->buf),
+			"Range: bytes=%lld-\r\nIf-Range: %.200s\r\n",
+			(long long)conn->written,
+			conn->etag && strncmp(conn->etag, "W/", 2) ?
+			conn->etag : conn->lastmod);
+		conn->validator = NULL;
+		conn->range_end = 0;
+	} else if (want_segments(conn)) {
+		segment_request(conn);
+		conn->validator = NULL;
+	} else if (!conn->is_hedge)
+		conn->validator = find_validator(conn,
+						 conn->regexp && !conn->matched ?
+						 conn->regfname : conn->outname);
+	if (conn->validator) {
+		if (conn->validator->etag)
+			sprintf(conn->buf + strlen(conn->buf),
+				"If-None-Match: %.200s\r\n", conn->validator->etag);
+		if (conn->validator->lastmod)
+			sprintf(conn->buf + strlen(conn->buf),
+				"If-Modified-Since: %.100s\r\n",
+				conn->validator->lastmod);
+	}
+
 	strcat(conn->buf, "\r\n");
 
 	conn->curp = conn->buf;
@@ -312,6 +457,12 @@ void write_request(struct connection *conn)
 {
 	int n; /* must be signed. windows does not support ssize_t */
 
+	if (conn->is_warm) {
+		/* Connected, nothing to send until it is taken */
+		conn->poll->events = 0;
+		return;
+	}
+
 #ifdef WANT_SSL
 	if (conn->ssl) {
 		n = openssl_write(conn);
@@ -336,6 +487,11 @@ void write_request(struct connection *conn)
 	} else if (n > 0) {
 		conn->length -= n;
 		conn->curp += n;
+	} else if (n < 0 && conn->tfo && (errno == EINPROGRESS || errno == EAGAIN)) {
+		/* Fast open without a cookie. The SYN went out alone,
+		 * send the request once we are connected. */
+		if (verbose > 1)
+			printf("+ Fast open deferred\n");
 	} else {
 		printf("Write request error\n");
 		fail_connection(conn);
@@ -388,6 +544,142 @@ static int redirect(struct connection *conn, int status)
 	return status;
 }
 
+#ifdef WANT_SSL
+/* The server wants the request after the handshake. This is not
+ * congestion, so send it again now rather than retry_connection. */
+static int too_early(struct connection *conn)
+{
+	char *tmpname = conn->tmpname;
+
+	/* Keep any partial file from an earlier try */
+	conn->tmpname = NULL;
+	release_connection(conn);
+	conn->tmpname = tmpname;
+
+	conn->early = -1; /* no 0-RTT this time */
+	if (build_request(conn))
+		return fail_redirect(conn);
+
+	return 0;
+}
+#endif
+
+/* Returns a copy of the header value or NULL */
+static char *get_header(struct connection *conn, const char *name)
+{
+	int len = strlen(name);
+	char *p, *e, *val;
+
+	for (p = strchr(conn->buf, '\n'); p; p = strchr(p, '\n')) {
+		++p;
+		if (strncasecmp(p, name, len) == 0 && p[len] == ':') {
+			for (p += len + 1; *p == ' ' || *p == '\t'; ++p)
+				;
+			for (e = p; *e && *e != '\r' && *e != '\n'; ++e)
+				;
+			val = malloc(e - p + 1);
+			if (val) {
+				memcpy(val, p, e - p);
+				val[e - p] = '\0';
+			}
+			return val;
+		}
+	}
+
+	return NULL;
+}
+
+/* Retry-After is either seconds or a date. Returns 0 if missing. */
+static int retry_after(struct connection *conn)
+{
+	char *val = get_header(conn, "Retry-After"), *e;
+	long secs;
+
+	if (!val)
+		return 0;
+
+	secs = strtol(val, &e, 10);
+#ifndef _WIN32
+	if (e == val) {
+		struct tm tm;
+
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(val, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+			secs = timegm(&tm) - time(NULL);
+	}
+#endif
+	free(val);
+
+	if (secs < 1)
+		return 0;
+	return secs > INT_MAX ? INT_MAX : secs;
+}
+
+/* Used for conditional GETs and If-Range */
+static void get_validators(struct connection *conn)
+{
+	free(conn->etag);
+	conn->etag = get_header(conn, "ETag");
+	free(conn->lastmod);
+	conn->lastmod = get_header(conn, "Last-Modified");
+}
+
+/* The 206 must start where we asked */
+static int check_range(struct connection *conn)
+{
+	char *range, *p;
+	off_t start;
+	int rc = 1;
+
+	if (conn->tmpname)
+		start = conn->written;
+	else if (conn->range_end)
+		start = conn->offset;
+	else {
+		printf("206 without a range request: %s\n", conn->url);
+		return 1;
+	}
+
+	range = get_header(conn, "Content-Range");
+	if (range && strncmp(range, "bytes ", 6) == 0 &&
+		strtoll(range + 6, NULL, 10) == start) {
+		p = strchr(range, '/');
+		conn->total = p ? strtoll(p + 1, NULL, 10) : 0;
+		rc = 0;
+	} else
+		printf("Bad range '%s' for %s\n", range ? range : "", conn->url);
+
+	free(range);
+	return rc;
+}
+
+/* Resuming: append on a 206, start over on a 200 */
+static int reopen_output(struct connection *conn, int append)
+{
+	conn->out = open(conn->tmpname,
+			 append ? O_WRONLY | O_BINARY : WRITE_FLAGS, 0664);
+	if (conn->out < 0) {
+		my_perror(conn->tmpname);
+		return 1;
+	}
+
+	if (append) {
+		if (lseek(conn->out, conn->written, SEEK_SET) < 0) {
+			my_perror(conn->tmpname);
+			return 1;
+		}
+	} else {
+		conn->written = 0;
+		if (conn->hashing)
+			store_start(conn);
+	}
+
+	if (verbose > 1)
+		printf("Output %s -> %s (%s)\n", conn->url, conn->tmpname,
+			   append ? "append" : "restart");
+	return 0;
+}
+
 /* State function */
 int read_reply(struct connection *conn)
 {
@@ -396,6 +688,9 @@ int read_reply(struct connection *conn)
 	int chunked = 0;
 	int needopen = 1;
 
+	if (conn->tfo)
+		fastopen_check(conn);
+
 	p = strstr(conn->buf, "\n\r\n");
 	if (p) {
 		*(p + 1) = '\0';
@@ -406,8 +701,8 @@ int read_reply(struct connection *conn)
 	} else if (conn->curp == conn->endp) {
 		printf("Unexpected reply EOF %s\n", conn->url);
 		return 1;
-	} else if (conn->rlen > 0) {
-		/* I have never seen this happen */
+	} else if (conn->rlen > 0 || grow_buf(conn) == 0) {
+		/* Partial header. Keep reading. */
 		conn->curp = conn->endp;
 		return 0;
 	} else {
@@ -429,11 +724,22 @@ int read_reply(struct connection *conn)
 	}
 
 	status = strtol(conn->buf + 9, NULL, 10);
+	conn->stats.status = status;
+	stats_mark(&conn->stats.reply);
 
 	switch (status) {
 	case 200: /* OK */
+		if (conn->parent) {
+			printf("Range ignored for %s\n", conn->url);
+			return 1;
+		}
+		conn->range_end = 0; /* the probe got it all */
+		/* fall thru */
+	case 206: /* Partial Content */
+		if (status == 206 && check_range(conn))
+			return 1;
 		if (verbose)
-			printf("200 %s\n", conn->url);
+			printf("%d %s\n", status, conn->url);
 
 		p = strstr(conn->buf, "Content-Length:");
 		if (!p)
@@ -458,30 +764,65 @@ int read_reply(struct connection *conn)
 			p += 17;
 			while (isspace(*p))
 				++p;
-			if (strncmp(p, "gzip", 4) == 0) {
-				if (verbose > 1)
-					printf("GZIP\n");
-				if (gzip_init(conn))
-					return 1;
-			}
-			else
-				printf("CE OH oh. %s: %s", conn->host, p);
+			if (decoder_init(conn, p))
+				return 1;
 		}
 		if (verbose > 1 && conn->length == 0 && !chunked)
 			printf("Warning: No content length for %s\n",
 				   conn->url);
+		get_validators(conn);
 		break;
 
+	case 304: /* Not Modified */
+		if (!conn->validator) {
+			printf("%d: %s\n", status, conn->url);
+			return status;
+		}
+		if (verbose)
+			printf("304 %s\n", conn->url);
+		get_validators(conn);
+		/* A 304 need not resend both */
+		if (!conn->etag && conn->validator->etag)
+			conn->etag = must_strdup(conn->validator->etag);
+		if (!conn->lastmod && conn->validator->lastmod)
+			conn->lastmod = must_strdup(conn->validator->lastmod);
+		if (conn->regexp && !conn->matched)
+			return do_process_html(conn);
+		/* Reuse the file we already have. We made sure the
+		 * name only differs by the extension. */
+		strcpy(conn->outname, conn->validator->fname);
+		conn->hash = conn->validator->hash;
+		if (store_link(conn->hash, conn->outname))
+			return 1;
+		close_connection(conn);
+		return 0;
+
 	case 301: /* Moved Permanently */
 	case 302: /* Moved Temporarily */
+	case 307: /* Temporary Redirect */
+	case 308: /* Permanent Redirect */
+		/* We only GET or HEAD so these are all the same */
 		return redirect(conn, status);
 
+#ifdef WANT_SSL
+	case 425: /* Too Early */
+		if (verbose)
+			printf("425 %s\n", conn->url);
+		return too_early(conn);
+#endif
+
+	case 429: /* Too Many Requests */
+	case 503: /* Service Unavailable */
+		printf("%d: %s\n", status, conn->url);
+		return retry_connection(conn, retry_after(conn));
+
 	case 0:
 		printf("HUH? NO STATUS\n");
 		status = 2;
 		/* fall thru */
 	default:
 		printf("%d: %s\n", status, conn->url);
+		stats_fail(conn, "status");
 		return status;
 	}
 
@@ -491,29 +832,33 @@ int read_reply(struct connection *conn)
 		return 0;
 	}
 
-	if (conn->regexp && !conn->matched)
+	if (conn->tmpname) {
+		if (reopen_output(conn, status == 206))
+			return 1;
+		needopen = 0;
+	} else if (conn->regexp && !conn->matched)
 		fname = conn->regfname;
 	else
 		needopen = 0; /* defer open */
 
 	if (needopen) {
-		conn->out = open(fname, WRITE_FLAGS, 0664);
-		if (conn->out < 0) {
-			my_perror(fname);
+		if (open_output(conn, fname))
 			return 1;
-		}
 
 		if (verbose > 1)
 			printf("Output %s -> %s\n", conn->url, fname);
-	} else if (verbose > 1)
+	} else if (verbose > 1 && conn->out == -1)
 		printf("Output %s deferred\n", conn->url);
 
 	if (chunked) {
 		conn->cstate = CS_DIGITS;
 		NEXT_STATE(conn, read_file_chunked);
 		conn->length = 0; /* paranoia */
-	} else if (conn->zs) {
-		NEXT_STATE(conn, read_file_gzip);
+	} else if (conn->decoder) {
+		if (conn->zs && oneshot_init(conn) == 0)
+			NEXT_STATE(conn, read_file_oneshot);
+		else
+			NEXT_STATE(conn, read_file_decoded);
 	} else if (conn->length == 0)
 		NEXT_STATE(conn, read_file_unsized);
 	else
@@ -527,30 +872,32 @@ int read_reply(struct connection *conn)
 
 
 /* This is the only place we write to the output file */
-static int write_output(struct connection *conn, int bytes)
+static int write_output(struct connection *conn, char *buf, int bytes)
 {
 	int n;
 
+	if (conn->parent)
+		return write_segment(conn, buf, bytes);
+
 	if (conn->out == -1) { /* deferred open */
 		/* We alloced space for the extension in add_outname */
-		char *buf = conn->zs ? (char *)conn->zs_buf : conn->curp;
 		if (want_extensions)
 			strcat(conn->outname, lazy_imgtype(buf));
 
-		conn->out = open(conn->outname, WRITE_FLAGS, 0664);
-		if (conn->out < 0) {
-			my_perror(conn->outname);
+		if (open_output(conn, conn->outname))
 			return 0;
-		}
 
 		if (verbose > 1)
 			printf("Output %s -> %s\n", conn->url, conn->outname);
+
+		store_start(conn);
 	}
 
-	if (conn->zs)
-		n = write(conn->out, conn->zs_buf, bytes);
-	else
-		n = write(conn->out, conn->curp, bytes);
+	store_update(conn, buf, bytes);
+
+	n = write(conn->out, buf, bytes);
+	if (n > 0)
+		conn->written += n;
 
 	if (n != bytes) {
 		if (n < 0)
@@ -576,12 +923,12 @@ static int read_chunkblock(struct connection *conn)
 		bytes = conn->length;
 
 	if (bytes > 0) {
-		if (conn->zs) {
-			if (write_output_gzipped(conn, bytes) < 0) {
-				printf("Gzipped write error\n");
+		if (conn->decoder) {
+			if (conn->decoder->write(conn, conn->curp, bytes) < 0) {
+				printf("Decoded write error\n");
 				return 1;
 			}
-		} else if (!write_output(conn, bytes))
+		} else if (!write_output(conn, conn->curp, bytes))
 			return 1;
 	}
 
@@ -620,8 +967,10 @@ static int read_chunkblock(struct connection *conn)
 static int read_file_chunked(struct connection *conn)
 {
 	if (conn->curp >= conn->endp) {
+		/* Closed before the last chunk. Try again from here. */
 		printf("Hmmm, %s already empty (%d)\n", conn->url, conn->rlen);
-		return 1;
+		reset_connection(conn);
+		return 0;
 	}
 
 	if (conn->cstate == CS_START_CR) {
@@ -694,42 +1043,56 @@ static int read_file_chunked(struct connection *conn)
 }
 
 #ifdef WANT_GZIP
+/* Window size 15 is default for zlib. Adding 32 allows us to handle
+ * gzip format. */
+#define ZWINDOW (15 + 32)
+
+/* Idle inflate states. inflateReset2() is much cheaper than a full
+ * inflateInit2(). */
+#define MAX_FREE_ZS	8
+
+static z_stream *zs_pool[MAX_FREE_ZS];
+static int n_zs;
+
 static int gzip_init(struct connection *conn)
 {
+	if (n_zs > 0) {
+		conn->zs = zs_pool[--n_zs];
+		if (inflateReset2(conn->zs, ZWINDOW) == Z_OK)
+			return 0;
+		inflateEnd(conn->zs);
+		free(conn->zs);
+	}
+
 	conn->zs = calloc(1, sizeof(z_stream));
 	if (!conn->zs) {
 		printf("Out of memory\n");
 		return 1;
 	}
 
-	conn->zs_buf = malloc(BUFSIZE);
-	if (!conn->zs_buf) {
-		printf("Out of memory\n");
+	if (inflateInit2(conn->zs, ZWINDOW)) {
+		free(conn->zs);
+		conn->zs = NULL;
 		return 1;
 	}
 
-	/* Window size 15 is default for zlib. Adding 32 allows us to
-	 * handle gzip format. */
-	if (inflateInit2(conn->zs, 15 + 32))
-		return 1;
-
 	return 0;
 }
 
-static int write_output_gzipped(struct connection *conn, size_t bytes)
+static int write_output_gzipped(struct connection *conn, char *in, size_t bytes)
 {
 	int rc, sz;
 	z_stream *zs = conn->zs;
-	zs->next_in = (unsigned char *)conn->curp;
+	zs->next_in = (unsigned char *)in;
 	zs->avail_in = bytes;
 
 	/* Inflate and write all output until we are done with the
 	 * input buffer. */
 	do {
-		zs->next_out = conn->zs_buf;
+		zs->next_out = dec_buf;
 		zs->avail_out = BUFSIZE;
 
-		rc = inflate(zs, Z_SYNC_FLUSH);
+		rc = inflate(zs, Z_NO_FLUSH);
 
 		switch (rc) {
 		case Z_BUF_ERROR:
@@ -739,10 +1102,16 @@ static int write_output_gzipped(struct connection *conn, size_t bytes)
 		case Z_OK:
 		case Z_STREAM_END:
 			sz = BUFSIZE - zs->avail_out;
-			if (sz <= 0)
-				return rc;
-			if (!write_output(conn, sz))
+			if (sz > 0 && !write_output(conn, (char *)dec_buf, sz))
 				return -1;
+			if (rc == Z_STREAM_END && zs->avail_in > 0 &&
+				*zs->next_in == 0x1f) {
+				/* Another gzip member follows */
+				if (inflateReset(zs) != Z_OK)
+					return -1;
+				zs->avail_out = 0; /* go round again */
+			} else if (sz <= 0)
+				return rc;
 			break;
 
 		default:
@@ -754,24 +1123,106 @@ static int write_output_gzipped(struct connection *conn, size_t bytes)
 	return rc;
 }
 
+#ifdef WANT_LIBDEFLATE
+/* Compressed pages bigger than this are streamed through zlib */
+#define ONESHOT_MAX	(1024 * 1024)
+
+static struct libdeflate_decompressor *decompressor;
+
+/* Only worth it if we can buffer the entire body */
+static int oneshot_init(struct connection *conn)
+{
+	if (conn->length <= 0 || conn->length > ONESHOT_MAX)
+		return 1;
+
+	if (!decompressor) {
+		decompressor = libdeflate_alloc_decompressor();
+		if (!decompressor)
+			return 1;
+	}
+
+	conn->zbody = malloc(conn->length);
+	if (!conn->zbody)
+		return 1;
+	conn->zlen = 0;
+
+	if (verbose > 1)
+		printf("One shot %d bytes\n", conn->length);
+
+	return 0;
+}
+
+static int oneshot_inflate(struct connection *conn)
+{
+	unsigned char *in = conn->zbody;
+	size_t inlen = conn->zlen, outlen, actual, used = 0;
+	enum libdeflate_result rc;
+	char *out;
+
+	if (inlen >= 18 && in[0] == 0x1f && in[1] == 0x8b) {
+		/* ISIZE, the last four bytes, is the uncompressed size */
+		outlen = in[inlen - 4] | in[inlen - 3] << 8 |
+			in[inlen - 2] << 16 | (size_t)in[inlen - 1] << 24;
+		if (outlen > ONESHOT_MAX * 64)
+			goto fallback;
+		out = malloc(outlen + 1);
+		if (!out)
+			goto fallback;
+		rc = libdeflate_gzip_decompress_ex(decompressor, in, inlen,
+						   out, outlen, &used, &actual);
+	} else {
+		/* deflate (zlib format) has no size hint */
+		outlen = inlen * 4;
+		out = NULL;
+		do {
+			free(out);
+			outlen *= 2;
+			out = malloc(outlen);
+			if (!out)
+				goto fallback;
+			rc = libdeflate_zlib_decompress_ex(decompressor, in, inlen,
+							   out, outlen, &used, &actual);
+		} while (rc == LIBDEFLATE_INSUFFICIENT_SPACE &&
+			 outlen < ONESHOT_MAX * 64);
+	}
+
+	/* libdeflate stops after the first gzip member */
+	if (rc == LIBDEFLATE_SUCCESS && used == inlen) {
+		int failed = actual > 0 && !write_output(conn, out, actual);
+		free(out);
+		return failed;
+	}
+
+	free(out);
+
+fallback:
+	/* Multiple gzip members, or just something libdeflate does
+	 * not like. Let zlib try. */
+	if (verbose > 1)
+		printf("One shot failed for %s\n", conn->url);
+	return write_output_gzipped(conn, (char *)in, inlen) < 0;
+}
+
 /* State function */
-static int read_file_gzip(struct connection *conn)
+static int read_file_oneshot(struct connection *conn)
 {
 	size_t bytes;
-	int rc;
 
 	bytes = conn->endp - conn->curp;
 	if (bytes <= 0) {
 		printf("Read file problems %zu for %s!\n", bytes, conn->url);
 		return 1;
 	}
+	if (bytes > (size_t)conn->length)
+		bytes = conn->length;
 
-	rc = write_output_gzipped(conn, bytes);
-	if (rc < 0)
-		return 1;
+	memcpy(conn->zbody + conn->zlen, conn->curp, bytes);
+	conn->zlen += bytes;
 
 	conn->length -= bytes;
-	if (conn->length <= 0 || rc == Z_STREAM_END) {
+	if (conn->length <= 0) {
+		if (oneshot_inflate(conn))
+			return 1;
 		if (verbose)
 			printf("OK %s\n", conn->url);
 		if (conn->regexp && !conn->matched)
@@ -784,36 +1235,263 @@ static int read_file_gzip(struct connection *conn)
 	return 0;
 }
 
+static void gzip_free_pool(void)
+{
+	while (n_zs > 0) {
+		inflateEnd(zs_pool[--n_zs]);
+		free(zs_pool[n_zs]);
+	}
+
+	if (decompressor) {
+		libdeflate_free_decompressor(decompressor);
+		decompressor = NULL;
+	}
+}
+#else
+static int oneshot_init(struct connection *conn) { return 1; }
+
+static int read_file_oneshot(struct connection *conn)
+{
+	return 1;
+}
+
+static void gzip_free_pool(void)
+{
+	while (n_zs > 0) {
+		inflateEnd(zs_pool[--n_zs]);
+		free(zs_pool[n_zs]);
+	}
+}
+#endif
+
 static void gzip_free(struct connection *conn)
 {
+#ifdef WANT_LIBDEFLATE
+	free(conn->zbody);
+	conn->zbody = NULL;
+#endif
 	if (conn->zs) {
-		inflateEnd(conn->zs);
-		free(conn->zs);
+		if (n_zs < MAX_FREE_ZS)
+			zs_pool[n_zs++] = conn->zs;
+		else {
+			inflateEnd(conn->zs);
+			free(conn->zs);
+		}
 		conn->zs = NULL;
-		free(conn->zs_buf);
-		conn->zs_buf = NULL;
 	}
 }
 #else
-static int gzip_init(struct connection *conn)
+static int oneshot_init(struct connection *conn) { return 1; }
+
+static int read_file_oneshot(struct connection *conn)
 {
-	puts("Sorry, no GZIP support.");
 	return 1;
 }
 
-static int read_file_gzip(struct connection *conn)
+static void gzip_free_pool(void) {}
+#endif
+
+#ifdef WANT_BROTLI
+static int brotli_init(struct connection *conn)
 {
-	return 1;
+	conn->dstate = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+	if (!conn->dstate) {
+		printf("Out of memory\n");
+		return 1;
+	}
+
+	return 0;
 }
 
-static int write_output_gzipped(struct connection *conn, size_t bytes)
+static int write_output_brotli(struct connection *conn, char *in, size_t bytes)
 {
-	return -1;
+	const uint8_t *next_in = (const uint8_t *)in;
+	size_t avail_in = bytes, avail_out;
+	uint8_t *next_out;
+	BrotliDecoderResult rc;
+
+	do {
+		next_out = dec_buf;
+		avail_out = BUFSIZE;
+
+		rc = BrotliDecoderDecompressStream(conn->dstate,
+						   &avail_in, &next_in,
+						   &avail_out, &next_out, NULL);
+		if (rc == BROTLI_DECODER_RESULT_ERROR) {
+			printf("Brotli failed: %s\n",
+			       BrotliDecoderErrorString(
+				       BrotliDecoderGetErrorCode(conn->dstate)));
+			return -1;
+		}
+
+		if (avail_out < BUFSIZE &&
+		    !write_output(conn, (char *)dec_buf, BUFSIZE - avail_out))
+			return -1;
+	} while (rc == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+
+	return rc == BROTLI_DECODER_RESULT_SUCCESS;
 }
 
-static void gzip_free(struct connection *conn) {}
+static void brotli_free(struct connection *conn)
+{
+	BrotliDecoderDestroyInstance(conn->dstate);
+	conn->dstate = NULL;
+}
 #endif
 
+#ifdef WANT_ZSTD
+/* Keep one idle context around. Resetting is cheap. */
+static ZSTD_DCtx *zstd_spare;
+
+static int zstd_init(struct connection *conn)
+{
+	if (zstd_spare) {
+		conn->dstate = zstd_spare;
+		zstd_spare = NULL;
+		ZSTD_DCtx_reset(conn->dstate, ZSTD_reset_session_only);
+		return 0;
+	}
+
+	conn->dstate = ZSTD_createDCtx();
+	if (!conn->dstate) {
+		printf("Out of memory\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int write_output_zstd(struct connection *conn, char *in, size_t bytes)
+{
+	ZSTD_inBuffer zin = { in, bytes, 0 };
+	ZSTD_outBuffer zout;
+	size_t rc;
+
+	do {
+		zout.dst = dec_buf;
+		zout.size = BUFSIZE;
+		zout.pos = 0;
+
+		rc = ZSTD_decompressStream(conn->dstate, &zout, &zin);
+		if (ZSTD_isError(rc)) {
+			printf("Zstd failed: %s\n", ZSTD_getErrorName(rc));
+			return -1;
+		}
+
+		if (zout.pos > 0 && !write_output(conn, (char *)dec_buf, zout.pos))
+			return -1;
+	} while (zin.pos < zin.size || zout.pos == zout.size);
+
+	/* 0 means a frame was fully decoded and flushed */
+	return rc == 0;
+}
+
+static void zstd_free(struct connection *conn)
+{
+	if (zstd_spare)
+		ZSTD_freeDCtx(conn->dstate);
+	else
+		zstd_spare = conn->dstate;
+	conn->dstate = NULL;
+}
+#endif
+
+static const struct decoder decoders[] = {
+#ifdef WANT_ZSTD
+	{ "zstd", zstd_init, write_output_zstd, zstd_free },
+#endif
+#ifdef WANT_BROTLI
+	{ "br", brotli_init, write_output_brotli, brotli_free },
+#endif
+#ifdef WANT_GZIP
+	{ "gzip", gzip_init, write_output_gzipped, gzip_free },
+	{ "deflate", gzip_init, write_output_gzipped, gzip_free },
+#endif
+	{ NULL }
+};
+
+static const char *accept_encoding(void)
+{
+	static char encodings[64];
+	const struct decoder *d;
+
+	if (*encodings == 0)
+		for (d = decoders; d->name; ++d) {
+			if (d != decoders)
+				strcat(encodings, ", ");
+			strcat(encodings, d->name);
+		}
+
+	return encodings;
+}
+
+static int decoder_init(struct connection *conn, const char *encoding)
+{
+	const struct decoder *d;
+
+	for (d = decoders; d->name; ++d)
+		if (strncmp(encoding, d->name, strlen(d->name)) == 0) {
+			if (verbose > 1)
+				printf("Encoding %s\n", d->name);
+			conn->decoder = d;
+			if (d->init(conn)) {
+				conn->decoder = NULL;
+				return 1;
+			}
+			return 0;
+		}
+
+	printf("CE OH oh. %s: %s", conn->host, encoding);
+	return 0;
+}
+
+static void decoder_free(struct connection *conn)
+{
+	if (conn->decoder) {
+		conn->decoder->free(conn);
+		conn->decoder = NULL;
+	}
+}
+
+static void decoder_free_pools(void)
+{
+	gzip_free_pool();
+#ifdef WANT_ZSTD
+	ZSTD_freeDCtx(zstd_spare);
+	zstd_spare = NULL;
+#endif
+}
+
+/* State function */
+static int read_file_decoded(struct connection *conn)
+{
+	size_t bytes;
+	int rc;
+
+	bytes = conn->endp - conn->curp;
+	if (bytes <= 0) {
+		printf("Read file problems %zu for %s!\n", bytes, conn->url);
+		return 1;
+	}
+
+	rc = conn->decoder->write(conn, conn->curp, bytes);
+	if (rc < 0)
+		return 1;
+
+	conn->length -= bytes;
+	if (conn->length <= 0 || rc == 1) {
+		if (verbose)
+			printf("OK %s\n", conn->url);
+		if (conn->regexp && !conn->matched)
+			return do_process_html(conn);
+		close_connection(conn);
+		return 0;
+	}
+
+	reset_buf(conn);
+	return 0;
+}
+
 /* State function */
 static int read_file_unsized(struct connection *conn)
 {
@@ -821,7 +1499,7 @@ static int read_file_unsized(struct connection *conn)
 
 	bytes = conn->endp - conn->curp;
 	if (bytes > 0) {
-		if (!write_output(conn, bytes))
+		if (!write_output(conn, conn->curp, bytes))
 			return 1;
 	} else {
 		if (verbose)
@@ -844,7 +1522,7 @@ static int read_file(struct connection *conn)
 
 	bytes = conn->endp - conn->curp;
 	if (bytes > 0) {
-		if (!write_output(conn, bytes))
+		if (!write_output(conn, conn->curp, bytes))
 			return 1;
 		conn->length -= bytes;
 		if (conn->length <= 0) {
@@ -856,8 +1534,10 @@ static int read_file(struct connection *conn)
 			return 0;
 		}
 	} else {
+		/* Closed early. Try again from here. */
 		printf("Read file problems %zu for %s!\n", bytes, conn->url);
-		return 1;
+		reset_connection(conn);
+		return 0;
 	}
 
 	reset_buf(conn);
@@ -873,9 +1553,14 @@ static int timeout_connections(void)
 	time_t timeout = now - read_timeout;
 
 	for (comic = comics; comic; comic = comic->next)
-		if (comic->poll && comic->access < timeout) {
+		if (comic->is_warm) {
+			if (comic->poll && comic->access < timeout)
+				drop_preconnect(comic);
+		} else if (comic->poll && comic->access < timeout) {
 			printf("TIMEOUT %s (n:%ld t:%ld a:%ld)\n",
 				   comic->url, now, timeout, comic->access);
+			sched_loss();
+			stats_fail(comic, "timeout");
 			fail_connection(comic);
 		}
 
@@ -903,10 +1588,16 @@ static void read_conn(struct connection *conn)
 		if (verbose > 1)
 			printf("+ Read %d/%d\n", n, conn->rlen);
 		if (n > 0) {
+			/* A full buffer means there is probably more
+			 * waiting. Grow the buffer for the next read. */
+			if (n == conn->bufsize)
+				conn->grow = 1;
 			conn->endp = conn->curp + n;
 			conn->rlen -= n;
 			*conn->endp = '\0';
-		}
+		} else
+			/* EOF: do not hand the last read to func again */
+			conn->endp = conn->curp;
 
 		if (conn->func && conn->func(conn))
 			fail_connection(conn);
@@ -925,8 +1616,9 @@ void main_loop(void)
 
 	while (head || outstanding > 0) {
 		start_next_comic();
+		sched_hedge();
 
-		n = poll(ufds, thread_limit, timeout);
+		n = poll(ufds, thread_limit, sched_timeout(timeout));
 		if (n < 0) {
 			my_perror("poll");
 			continue;
@@ -934,6 +1626,7 @@ void main_loop(void)
 
 		if (n == 0) {
 			timeout_connections();
+			sched_requeue();
 			if (!start_next_comic())
 				/* Once we have all the comics
 				 * started, increase the timeout
@@ -959,9 +1652,17 @@ void main_loop(void)
 				else
 					read_conn(conn);
 			}
+		sched_requeue();
 	}
 
 	free(ufds);
+	free_freelist();
+	decoder_free_pools();
+#ifdef WANT_SSL
+	openssl_exit();
+#endif
+	fastopen_exit();
+	sources_exit();
 }
 
 int set_conn_socket(struct connection *conn, int sock)
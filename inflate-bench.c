@@ -0,0 +1,205 @@
+/*
+ * inflate-bench.c - compare streaming zlib with one shot libdeflate
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Feed it gzipped index pages, e.g. from curl -H "Accept-Encoding: gzip", and it
+ * decompresses each one the way http.c does. Build against zlib,
+ * zlib-ng, and/or with WANT_LIBDEFLATE to compare.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <zlib.h>
+#ifdef WANT_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+/* Same as get-comics.h */
+#define BUFSIZE		(64 * 1024)
+
+static unsigned char out_buf[BUFSIZE];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char *read_file(const char *fname, size_t *len)
+{
+	unsigned char *buf;
+	FILE *fp = fopen(fname, "rb");
+	if (!fp) {
+		printf("%s: %s\n", fname, strerror(errno));
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	*len = ftell(fp);
+	rewind(fp);
+
+	buf = malloc(*len);
+	if (!buf || fread(buf, 1, *len, fp) != *len) {
+		printf("%s: read failed\n", fname);
+		free(buf);
+		buf = NULL;
+	}
+
+	fclose(fp);
+	return buf;
+}
+
+/* Mimic read_file_gzip(): the body arrives in chunk sized pieces and
+ * the z_stream is recycled with inflateReset2(). */
+static size_t zlib_stream(z_stream *zs, unsigned char *in, size_t len, size_t chunk)
+{
+	size_t total = 0, n;
+	int rc = Z_OK;
+
+	inflateReset2(zs, 15 + 32);
+
+	while (len > 0 && rc != Z_STREAM_END) {
+		n = len < chunk ? len : chunk;
+		zs->next_in = in;
+		zs->avail_in = n;
+		do {
+			zs->next_out = out_buf;
+			zs->avail_out = BUFSIZE;
+			rc = inflate(zs, Z_NO_FLUSH);
+			if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+				printf("Inflate failed: %d\n", rc);
+				return 0;
+			}
+			total += BUFSIZE - zs->avail_out;
+		} while (zs->avail_out == 0);
+		in += n;
+		len -= n;
+	}
+
+	return total;
+}
+
+#ifdef WANT_LIBDEFLATE
+static size_t oneshot(struct libdeflate_decompressor *d, unsigned char *in, size_t len)
+{
+	size_t outlen, actual;
+	unsigned char *out;
+	int rc;
+
+	outlen = in[len - 4] | in[len - 3] << 8 |
+		in[len - 2] << 16 | (size_t)in[len - 1] << 24;
+	out = malloc(outlen + 1);
+	if (!out)
+		return 0;
+
+	rc = libdeflate_gzip_decompress(d, in, len, out, outlen, &actual);
+	free(out);
+	if (rc) {
+		printf("libdeflate failed: %d\n", rc);
+		return 0;
+	}
+
+	return actual;
+}
+#endif
+
+static void usage(int rc)
+{
+	puts("usage: inflate-bench [-c chunk] [-n iterations] file.gz ...");
+	exit(rc);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, c, iterations = 1000;
+	size_t chunk = 1440; /* see BUFSIZE comment in get-comics.h */
+	z_stream zs;
+
+	while ((c = getopt(argc, argv, "c:hn:")) != -1)
+		switch (c) {
+		case 'c':
+			chunk = strtol(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(0);
+		case 'n':
+			iterations = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(1);
+		}
+
+	if (optind == argc || chunk == 0 || iterations <= 0)
+		usage(1);
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 15 + 32)) {
+		puts("inflateInit2 failed");
+		return 1;
+	}
+
+#ifdef WANT_LIBDEFLATE
+	struct libdeflate_decompressor *d = libdeflate_alloc_decompressor();
+	if (!d) {
+		puts("libdeflate_alloc_decompressor failed");
+		return 1;
+	}
+#endif
+
+	printf("zlib %s\n", zlibVersion());
+
+	for (; optind < argc; ++optind) {
+		size_t len, out = 0;
+		double start, secs;
+		unsigned char *in = read_file(argv[optind], &len);
+		if (!in)
+			continue;
+		if (len < 18) {
+			printf("%s: too small\n", argv[optind]);
+			free(in);
+			continue;
+		}
+
+		start = now();
+		for (i = 0; i < iterations; ++i)
+			out = zlib_stream(&zs, in, len, chunk);
+		secs = now() - start;
+		printf("%s: %zu -> %zu\n", argv[optind], len, out);
+		printf("  stream  %8.1f us %8.1f MB/s\n", secs * 1e6 / iterations,
+			   out * (double)iterations / secs / 1e6);
+
+#ifdef WANT_LIBDEFLATE
+		start = now();
+		for (i = 0; i < iterations; ++i)
+			out = oneshot(d, in, len);
+		secs = now() - start;
+		printf("  oneshot %8.1f us %8.1f MB/s\n", secs * 1e6 / iterations,
+			   out * (double)iterations / secs / 1e6);
+#endif
+
+		free(in);
+	}
+
+#ifdef WANT_LIBDEFLATE
+	libdeflate_free_decompressor(d);
+#endif
+	inflateEnd(&zs);
+
+	return 0;
+}
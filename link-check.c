@@ -84,8 +84,8 @@ static int read_link_file(char *fname)
 
 static void usage(int rc)
 {
-	fputs("usage: link-check [-dv] [-t threads]", stdout);
-	puts(" [-T timeout] [link_file ...]");
+	fputs("usage: link-check [-dv] [-b source_addr] [-j reactors]", stdout);
+	puts(" [-t threads] [-T timeout] [link_file ...]");
 	exit(rc);
 }
 
@@ -94,11 +94,23 @@ int main(int argc, char *argv[])
 	int i;
 
 	method = "HEAD";
+	pace_ms = 0; /* HEADs are cheap */
 
-	while ((i = getopt(argc, argv, "ht:vT:")) != -1)
+	while ((i = getopt(argc, argv, "b:hj:t:vT:")) != -1)
 		switch ((char)i) {
+		case 'b':
+			if (add_source(optarg))
+				exit(1);
+			break;
 		case 'h':
 			usage(0);
+		case 'j':
+#ifdef WANT_CURL
+			puts("Reactors are not supported with curl");
+#else
+			reactors = strtol(optarg, NULL, 0);
+#endif
+			break;
 		case 't':
 			thread_limit = strtol(optarg, NULL, 0);
 			break;
@@ -133,7 +145,7 @@ int main(int argc, char *argv[])
 	signal(SIGHUP, dump_outstanding);
 #endif
 
-	main_loop();
+	run_reactors();
 
 	out_results(comics, 0);
 
@@ -28,6 +28,12 @@
 #ifndef MBEDTLS_CONFIG_H
 #define MBEDTLS_CONFIG_H
 
+/* Comment in for the low memory profile. The record buffers, about
+ * 33k per connection by default, shrink to about 5k, and we ask the
+ * server for small records with the max_fragment_length extension.
+ * Servers that ignore the extension will fail the handshake. */
+//#define GET_COMICS_LOW_MEMORY
+
 /* System support */
 #define MBEDTLS_HAVE_ASM
 #define MBEDTLS_HAVE_TIME
@@ -37,6 +43,14 @@
 #define MBEDTLS_PKCS1_V15
 #define MBEDTLS_KEY_EXCHANGE_RSA_ENABLED
 #define MBEDTLS_SSL_PROTO_TLS1_1
+#define MBEDTLS_SSL_SERVER_NAME_INDICATION
+
+#ifdef GET_COMICS_LOW_MEMORY
+#define MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+#define MBEDTLS_SSL_IN_CONTENT_LEN		4096
+/* Our requests are small */
+#define MBEDTLS_SSL_OUT_CONTENT_LEN		1024
+#endif
 
 /* mbed TLS modules */
 #define MBEDTLS_AES_C
@@ -6,12 +6,149 @@
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/error.h"
 #include "mbedtls/net.h"
+#include "mbedtls/version.h"
 
 static int initialized;
 static mbedtls_ssl_config config;
 static mbedtls_entropy_context entropy;
 static mbedtls_ctr_drbg_context ctr_drbg;
 
+/* Contexts are kept for reuse. mbedtls_ssl_session_reset() keeps the
+ * record buffers, so we only pay for the malloc once per slot. */
+struct ssl_pool {
+	mbedtls_ssl_context *ssl;
+	struct ssl_pool *next;
+};
+
+static struct ssl_pool *pool;
+
+/* Before 2.13 there was one content length for both directions */
+#ifndef MBEDTLS_SSL_IN_CONTENT_LEN
+#define MBEDTLS_SSL_IN_CONTENT_LEN	MBEDTLS_SSL_MAX_CONTENT_LEN
+#define MBEDTLS_SSL_OUT_CONTENT_LEN	MBEDTLS_SSL_MAX_CONTENT_LEN
+#endif
+
+#ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+/* Ask the server for records no bigger than our input buffer */
+#if MBEDTLS_SSL_IN_CONTENT_LEN <= 512
+#define MFL_CODE MBEDTLS_SSL_MAX_FRAG_LEN_512
+#elif MBEDTLS_SSL_IN_CONTENT_LEN <= 1024
+#define MFL_CODE MBEDTLS_SSL_MAX_FRAG_LEN_1024
+#elif MBEDTLS_SSL_IN_CONTENT_LEN <= 2048
+#define MFL_CODE MBEDTLS_SSL_MAX_FRAG_LEN_2048
+#elif MBEDTLS_SSL_IN_CONTENT_LEN <= 4096
+#define MFL_CODE MBEDTLS_SSL_MAX_FRAG_LEN_4096
+#else
+#define MFL_CODE MBEDTLS_SSL_MAX_FRAG_LEN_NONE
+#endif
+#endif
+
+static void ssl_init(void)
+{
+	static const char pers[] = "get-comics";
+
+	initialized = 1;
+
+	mbedtls_entropy_init(&entropy);
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+							  (const unsigned char *)pers, sizeof(pers) - 1)) {
+		printf("Could not seed PRNG\n");
+		exit(1);
+	}
+
+	mbedtls_ssl_config_init(&config);
+	if (mbedtls_ssl_config_defaults(&config,
+									MBEDTLS_SSL_IS_CLIENT,
+									MBEDTLS_SSL_TRANSPORT_STREAM,
+									MBEDTLS_SSL_PRESET_DEFAULT)) {
+		printf("Unable to initialize ssl defaults\n");
+		exit(1);
+	}
+
+	mbedtls_ssl_conf_rng(&config, mbedtls_ctr_drbg_random, &ctr_drbg);
+
+	/* Like openssl.c, do not abort on a bad certificate */
+	mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_NONE);
+
+#ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+	if (mbedtls_ssl_conf_max_frag_len(&config, MFL_CODE))
+		printf("Unable to set max fragment length\n");
+#endif
+}
+
+static mbedtls_ssl_context *ssl_get(void)
+{
+	mbedtls_ssl_context *ssl;
+
+	if (pool) {
+		struct ssl_pool *p = pool;
+
+		pool = p->next;
+		ssl = p->ssl;
+		free(p);
+		if (mbedtls_ssl_session_reset(ssl) == 0)
+			return ssl;
+		mbedtls_ssl_free(ssl);
+	} else {
+		ssl = malloc(sizeof(mbedtls_ssl_context));
+		if (!ssl) {
+			printf("Out of memory");
+			return NULL;
+		}
+	}
+
+	mbedtls_ssl_init(ssl);
+	if (mbedtls_ssl_setup(ssl, &config)) {
+		printf("Unable to set ssl defaults\n");
+		mbedtls_ssl_free(ssl);
+		free(ssl);
+		return NULL;
+	}
+
+	return ssl;
+}
+
+static void ssl_put(mbedtls_ssl_context *ssl)
+{
+	struct ssl_pool *p = malloc(sizeof(struct ssl_pool));
+
+	if (!p) {
+		mbedtls_ssl_free(ssl);
+		free(ssl);
+		return;
+	}
+
+	p->ssl = ssl;
+	p->next = pool;
+	pool = p;
+}
+
+/* The largest records this connection takes and sends, after the
+ * max_fragment_length negotiation. The record buffers are these plus
+ * the header, IV and MAC. */
+static void print_records(struct connection *conn)
+{
+	int in, out;
+
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+	in = mbedtls_ssl_get_max_in_record_payload(conn->ssl);
+#elif defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH) && \
+	MBEDTLS_VERSION_NUMBER >= 0x02100000
+	in = (int)mbedtls_ssl_get_input_max_frag_len(conn->ssl);
+#else
+	in = MBEDTLS_SSL_IN_CONTENT_LEN;
+#endif
+
+#if MBEDTLS_VERSION_NUMBER >= 0x02100000
+	out = mbedtls_ssl_get_max_out_record_payload(conn->ssl);
+#else
+	out = MBEDTLS_SSL_OUT_CONTENT_LEN;
+#endif
+
+	printf("TLS records for %s: %d in %d out\n", conn->host, in, out);
+}
+
 int openssl_check_connect(struct connection *conn)
 {
 	int rc = mbedtls_ssl_handshake(conn->ssl);
@@ -22,6 +159,8 @@ int openssl_check_connect(struct connection *conn)
 		if (verbose)
 			printf("Ciphersuite is %s\n",
 				   mbedtls_ssl_get_ciphersuite(conn->ssl));
+		if (verbose)
+			print_records(conn);
 		return 0;
 	case MBEDTLS_ERR_SSL_WANT_READ:
 		set_readable(conn);
@@ -31,7 +170,7 @@ int openssl_check_connect(struct connection *conn)
 		return 0;
 	case MBEDTLS_ERR_NET_CONN_RESET:
 		reset_connection(conn);
-		return 1;
+		return 0;
 	default:
 		printf("Not read or write 0x%x\n", rc);
 		return 1;
@@ -41,38 +180,25 @@ int openssl_check_connect(struct connection *conn)
 /* Returns an opaque ssl context */
 int openssl_connect(struct connection *conn)
 {
-	if (!initialized) {
-		initialized = 1;
-
-		mbedtls_entropy_init(&entropy);
-		mbedtls_ctr_drbg_init(&ctr_drbg);
-
-		mbedtls_ssl_config_init(&config);
-		if (mbedtls_ssl_config_defaults(&config,
-										MBEDTLS_SSL_IS_CLIENT,
-										MBEDTLS_SSL_TRANSPORT_STREAM,
-										MBEDTLS_SSL_PRESET_DEFAULT)) {
-			printf("Unable to initialize ssl defaults\n");
-			exit(1);
-		}
-	}
+	char host[256], *p;
 
-	mbedtls_ssl_context *ssl = malloc(sizeof(mbedtls_ssl_context));
-	if (!ssl) {
-		printf("Out of memory");
-		return 1;
-	}
+	if (!initialized)
+		ssl_init();
 
-	mbedtls_ssl_init(ssl);
-	if (mbedtls_ssl_setup(ssl, &config)) {
-		printf("Unable to set ssl defaults\n");
-		exit(1);
-	}
+	mbedtls_ssl_context *ssl = ssl_get();
+	if (!ssl)
+		return 1;
 
 	conn->ssl = ssl;
 
-
-//	mbedtls_ssl_set_rng(ssl, ctr_drbg_random, &ctr_drbg);
+	/* SNI wants the host without the scheme or port */
+	p = is_http(conn->host);
+	snprintf(host, sizeof(host), "%s", p ? p : conn->host);
+	host[strcspn(host, ":/")] = '\0';
+	if (mbedtls_ssl_set_hostname(ssl, host)) {
+		printf("Unable to set hostname %s\n", host);
+		return 1;
+	}
 
 	int *fd = &conn->poll->fd;
 	mbedtls_ssl_set_bio(ssl, fd, mbedtls_net_send, mbedtls_net_recv, NULL);
@@ -112,12 +238,30 @@ int openssl_write(struct connection *conn)
 	return n;
 }
 
+void openssl_exit(void)
+{
+	while (pool) {
+		struct ssl_pool *p = pool;
+
+		pool = p->next;
+		mbedtls_ssl_free(p->ssl);
+		free(p->ssl);
+		free(p);
+	}
+
+	if (initialized) {
+		mbedtls_ssl_config_free(&config);
+		mbedtls_ctr_drbg_free(&ctr_drbg);
+		mbedtls_entropy_free(&entropy);
+		initialized = 0;
+	}
+}
+
 void openssl_close(struct connection *conn)
 {
 	if (conn->ssl) {
 		mbedtls_ssl_close_notify(conn->ssl);
-		mbedtls_ssl_free(conn->ssl);
-		free(conn->ssl);
+		ssl_put(conn->ssl);
 		conn->ssl = NULL;
 	}
 }
@@ -9,6 +9,37 @@
  * connections.  */
 static SSL_CTX *ssl_ctx;
 
+/* Client session cache. We keep the latest session for each SNI host
+ * so the next connection to that host resumes rather than doing a
+ * full handshake. TLS 1.3 tickets arrive after the handshake and come
+ * in through new_session(). With a state dir the sessions are saved
+ * between runs, one per line:
+ *
+ *     host session
+ *
+ * where session is the DER encoding in hex. The file holds session
+ * secrets, so only we can read it.
+ */
+#define TLS_SESSIONS	"tls-sessions"
+
+struct tls_session {
+	char *host;
+	SSL_SESSION *sess;
+	struct tls_session *next;
+};
+
+static struct tls_session *sessions;
+static int sessions_dirty;
+
+/* With early_data set, a GET or HEAD on a resumed TLS 1.3 session is
+ * sent as 0-RTT early data with the ClientHello. If the server
+ * rejects it we send it again after the handshake. A 425 from the
+ * server turns 0-RTT off for that connection.
+ */
+enum { EARLY_NONE, EARLY_WANT, EARLY_SENT };
+
+static int early_tries, early_accepted;
+
 static void print_errors(void)
 {
 	unsigned long err;
@@ -16,6 +47,137 @@ static void print_errors(void)
 		printf("OpenSSL: %s\n", ERR_error_string(err, NULL));
 }
 
+/* The host name without the scheme or port */
+static void sni_host(struct connection *conn, char *host, int len)
+{
+	char *p = is_http(conn->host);
+
+	snprintf(host, len, "%s", p ? p : conn->host);
+	host[strcspn(host, ":/")] = '\0';
+}
+
+static int session_expired(SSL_SESSION *sess)
+{
+	return SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) <
+		time(NULL);
+}
+
+static struct tls_session *find_session(const char *host)
+{
+	struct tls_session *s;
+
+	for (s = sessions; s; s = s->next)
+		if (strcmp(s->host, host) == 0)
+			return s;
+	return NULL;
+}
+
+/* Takes over the reference to sess */
+static void set_session(const char *host, SSL_SESSION *sess)
+{
+	struct tls_session *s = find_session(host);
+
+	if (s)
+		SSL_SESSION_free(s->sess);
+	else {
+		s = must_alloc(sizeof(struct tls_session));
+		s->host = must_strdup(host);
+		s->next = sessions;
+		sessions = s;
+	}
+	s->sess = sess;
+	sessions_dirty = 1;
+}
+
+static int new_session(SSL *ssl, SSL_SESSION *sess)
+{
+	const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+	if (!host || !SSL_SESSION_is_resumable(sess))
+		return 0;
+
+	set_session(host, sess);
+	return 1; /* we keep the reference */
+}
+
+static void load_sessions(void)
+{
+	char path[PATH_MAX], line[16 * 1024], *host, *hex;
+	unsigned char der[sizeof(line) / 2];
+	const unsigned char *p;
+	SSL_SESSION *sess;
+	FILE *fp;
+	int i, n;
+
+	if (!state_dir)
+		return;
+
+	fp = fopen(state_path(TLS_SESSIONS, path, sizeof(path)), "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		host = strtok(line, " \n");
+		hex = strtok(NULL, " \n");
+		if (!host || !hex)
+			continue;
+
+		for (n = 0; hex[n * 2] && hex[n * 2 + 1]; ++n)
+			if (sscanf(hex + n * 2, "%2x", &i) == 1)
+				der[n] = i;
+			else
+				break;
+
+		p = der;
+		sess = d2i_SSL_SESSION(NULL, &p, n);
+		if (!sess)
+			continue;
+		if (session_expired(sess))
+			SSL_SESSION_free(sess);
+		else
+			set_session(host, sess);
+	}
+
+	fclose(fp);
+	sessions_dirty = 0;
+}
+
+static void save_sessions(void)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct tls_session *s;
+	unsigned char *der, *p;
+	FILE *fp;
+	int fd, i, n;
+
+	state_path(TLS_SESSIONS ".tmp", tmp, sizeof(tmp));
+	fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		my_perror(tmp);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	for (s = sessions; s; s = s->next) {
+		if (session_expired(s->sess))
+			continue;
+		n = i2d_SSL_SESSION(s->sess, NULL);
+		if (n <= 0)
+			continue;
+		der = p = must_alloc(n);
+		i2d_SSL_SESSION(s->sess, &p);
+		fprintf(fp, "%s ", s->host);
+		for (i = 0; i < n; ++i)
+			fprintf(fp, "%02x", der[i]);
+		fputc('\n', fp);
+		free(der);
+	}
+
+	if (fclose(fp) || rename(tmp, state_path(TLS_SESSIONS, path, sizeof(path))))
+		my_perror(path);
+}
+
 static int openssl_init(void)
 {
 	if (ssl_ctx)
@@ -43,11 +205,103 @@ static int openssl_init(void)
 
 	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
 
+	/* We keep the sessions, not OpenSSL */
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT |
+								   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl_ctx, new_session);
+	load_sessions();
+
+	return 0;
+}
+
+void openssl_exit(void)
+{
+	struct tls_session *s;
+
+	if (!ssl_ctx)
+		return;
+
+	if (state_dir && sessions_dirty)
+		save_sessions();
+
+	if (verbose && early_tries)
+		printf("0-RTT accepted %d of %d\n", early_accepted, early_tries);
+
+	while ((s = sessions)) {
+		sessions = s->next;
+		SSL_SESSION_free(s->sess);
+		free(s->host);
+		free(s);
+	}
+
+	SSL_CTX_free(ssl_ctx);
+	ssl_ctx = NULL;
+}
+
+static int want_early(struct connection *conn, struct tls_session *s)
+{
+	return early_data && s && conn->early != -1 &&
+		(*method == 'G' || *method == 'H') &&
+		conn->length > 0 && conn->curp == conn->buf &&
+		conn->length <= SSL_SESSION_get_max_early_data(s->sess);
+}
+
+static int write_early(struct connection *conn)
+{
+	size_t n;
+
+	while (conn->length > 0) {
+		if (!SSL_write_early_data(conn->ssl, conn->curp, conn->length, &n))
+			switch (SSL_get_error(conn->ssl, 0)) {
+			case SSL_ERROR_WANT_READ:
+				set_readable(conn);
+				return -EAGAIN;
+			case SSL_ERROR_WANT_WRITE:
+				set_writable(conn);
+				return -EAGAIN;
+			default:
+				printf("%s: early data failed\n", conn->url);
+				print_errors();
+				return 1;
+			}
+		conn->curp += n;
+		conn->length -= n;
+	}
+
+	conn->early = EARLY_SENT;
+	++conn->early_sent;
+	++early_tries;
 	return 0;
 }
 
+static void check_early(struct connection *conn)
+{
+	if (conn->early != EARLY_SENT)
+		return;
+
+	conn->early = EARLY_NONE;
+	if (SSL_get_early_data_status(conn->ssl) == SSL_EARLY_DATA_ACCEPTED) {
+		++conn->early_accepted;
+		++early_accepted;
+		if (verbose > 1)
+			printf("0-RTT accepted for %s\n", conn->url);
+	} else {
+		/* Send it again the normal way */
+		conn->curp = conn->buf;
+		conn->length = strlen(conn->buf);
+		if (verbose > 1)
+			printf("0-RTT rejected for %s\n", conn->url);
+	}
+}
+
 int openssl_check_connect(struct connection *conn)
 {
+	if (conn->early == EARLY_WANT) {
+		int rc = write_early(conn);
+		if (rc)
+			return rc == -EAGAIN ? 0 : rc;
+	}
+
 	errno = 0;
 	int ret = SSL_connect(conn->ssl);
 	if (ret < 0)
@@ -72,6 +326,10 @@ int openssl_check_connect(struct connection *conn)
 
 	conn->connected = 1;
 
+	if (verbose > 1 && SSL_session_reused(conn->ssl))
+		printf("Resumed TLS session for %s\n", conn->host);
+	check_early(conn);
+
 	set_writable(conn);
 
 	return 0;
@@ -80,6 +338,8 @@ int openssl_check_connect(struct connection *conn)
 /* Returns an opaque ssl context */
 int openssl_connect(struct connection *conn)
 {
+	struct tls_session *s;
+	char host[256];
 	SSL *ssl;
 
 	if (openssl_init())
@@ -89,9 +349,18 @@ int openssl_connect(struct connection *conn)
 	if (!ssl)
 		goto error;
 
-	if (SSL_set_tlsext_host_name(ssl, conn->host) == 0)
+	sni_host(conn, host, sizeof(host));
+	if (SSL_set_tlsext_host_name(ssl, host) == 0)
 		goto error;
 
+	s = find_session(host);
+	if (s && session_expired(s->sess))
+		s = NULL;
+	if (s)
+		SSL_set_session(ssl, s->sess);
+	if (conn->early != -1)
+		conn->early = want_early(conn, s) ? EARLY_WANT : EARLY_NONE;
+
 	conn->ssl = ssl;
 
 	if (!SSL_set_fd(ssl, conn->poll->fd))
@@ -135,6 +404,9 @@ int openssl_write(struct connection *conn)
 {
 	int n, err;
 
+	if (conn->length == 0)
+		return 0; /* all sent as early data */
+
 	do
 		n = SSL_write(conn->ssl, conn->curp, conn->length);
 	while (n < 0 &&
@@ -157,6 +429,13 @@ int openssl_write(struct connection *conn)
 
 void openssl_close(struct connection *conn)
 {
+	if (conn->early_sent) {
+		if (verbose)
+			printf("0-RTT %s: accepted %d of %d\n", conn->url,
+				   conn->early_accepted, conn->early_sent);
+		conn->early_sent = conn->early_accepted = 0;
+	}
+
 	if (conn->ssl) {
 		SSL_shutdown(conn->ssl);
 		SSL_free(conn->ssl);
@@ -0,0 +1,162 @@
+#include "get-comics.h"
+
+/* Pre-connects (the preconnect config key).
+ *
+ * The image of a two stage comic usually comes from a host we can
+ * guess before the index page is in: the regexp starts with it, or the
+ * last run got the image from there. While the index page downloads,
+ * we connect, and for https handshake, to that host. The connection
+ * then sits idle with no events. When process_html asks for the image,
+ * build_request takes the socket over if the host matches. Otherwise
+ * it is dropped.
+ *
+ * The pre-connect goes in the comics list after its owner so the main
+ * loop drives the connect. It counts as outstanding but is not a
+ * comic.
+ */
+
+/* The scheme and host at the start of the regexp. An unescaped dot is
+ * taken as a dot. https? gets the scheme of the index page. */
+static int regexp_host(struct connection *conn, char *host, int len)
+{
+	const char *p = conn->regexp;
+	const char *scheme = is_https(conn->url) ? "https" : "http";
+	int n, start;
+
+	if (*p == '^')
+		++p;
+	if (strncmp(p, "https?://", 9) == 0)
+		p += 9;
+	else if (strncmp(p, "https://", 8) == 0) {
+		scheme = "https";
+		p += 8;
+	} else if (strncmp(p, "http://", 7) == 0) {
+		scheme = "http";
+		p += 7;
+	} else
+		return 1;
+
+	n = start = snprintf(host, len, "%s://", scheme);
+	while (*p != '/') {
+		if (*p == '\\' && p[1] == '.')
+			++p;
+		else if (!isalnum(*p) && *p != '.' && *p != '-' && *p != ':')
+			return 1; /* end of string or not a literal */
+		if (n >= len - 1)
+			return 1;
+		host[n++] = *p++;
+	}
+	host[n] = '\0';
+
+	return n == start;
+}
+
+/* Where we expect the image of conn to be, as scheme://host[:port].
+ * Returns 0 if we have a guess that is not the index host. */
+int predict_host(struct connection *conn, char *host, int len)
+{
+	const char *last;
+
+	if (!conn->regexp || conn->matched)
+		return 1;
+
+	if (regexp_host(conn, host, len)) {
+		last = stats_last_host(conn);
+		if (!last)
+			return 1;
+		snprintf(host, len, "%s://%s",
+				 is_https(conn->url) ? "https" : "http", last);
+	}
+
+	return strcmp(host, conn->host) == 0;
+}
+
+/* Connect to host for conn. Returns NULL if we could not. */
+struct connection *start_preconnect(struct connection *conn, const char *host)
+{
+	struct connection *warm = must_alloc(sizeof(struct connection));
+	char name[256], *port;
+
+	warm->out = -1;
+	warm->id = conn->id;
+	warm->gotit = 1; /* not a comic, keep out of out_results */
+	warm->is_warm = 1;
+	warm->url = must_strdup(host);
+	warm->host = must_strdup(host);
+#ifdef WANT_SSL
+	warm->early = -1; /* nothing to send */
+#endif
+
+	warm->warm = conn;
+	conn->warm = warm;
+	warm->next = conn->next;
+	conn->next = warm;
+
+	time(&warm->access);
+	++outstanding;
+	if (verbose)
+		printf("Pre-connect %s for %s (%d)\n", host, conn->url, outstanding);
+
+	snprintf(name, sizeof(name), "%s", is_http(warm->host));
+	port = strchr(name, ':');
+	if (port)
+		*port++ = '\0';
+	else
+		port = is_https(warm->host) ? "443" : "80";
+
+	if (connect_socket(warm, name, port)) {
+		drop_preconnect(warm);
+		return NULL;
+	}
+
+	return warm;
+}
+
+/* Give conn its pre-connect if it is to the right host. Returns 1 if
+ * conn now has a connection. */
+int take_preconnect(struct connection *conn)
+{
+	struct connection *warm = conn->warm;
+
+	if (!warm || conn->is_warm)
+		return 0;
+
+	if (!warm->poll || strcmp(warm->host, conn->host) ||
+		(warm->poll->revents & (POLLERR | POLLHUP))) {
+		if (verbose > 1)
+			printf("Pre-connect %s missed\n", warm->host);
+		drop_preconnect(warm);
+		return 0;
+	}
+
+	conn->poll = warm->poll;
+	conn->connected = warm->connected;
+	warm->poll = NULL;
+#ifdef WANT_SSL
+	conn->ssl = warm->ssl;
+	warm->ssl = NULL;
+#endif
+	/* Still handshaking keeps the events the handshake wants */
+	if (conn->connected)
+		set_writable(conn);
+
+	if (verbose)
+		printf("Warm connection for %s%s\n", conn->url,
+			   conn->connected ? "" : " (connecting)");
+	drop_preconnect(warm);
+	return 1;
+}
+
+void drop_preconnect(struct connection *warm)
+{
+	if (!warm->warm)
+		return; /* already dropped */
+
+	warm->warm->warm = NULL;
+	warm->warm = NULL;
+	--outstanding;
+	sched_done(warm);
+	if (verbose > 1 && warm->poll)
+		printf("Drop pre-connect %s (%d)\n", warm->host, outstanding);
+	release_connection(warm);
+}
@@ -0,0 +1,122 @@
+#include "get-comics.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* Multi-reactor mode (-j for link-check and http-get).
+ *
+ * The raw engine keeps a lot of per process state: the buffer pool,
+ * the decoder buffers, the scheduler and the TLS context. Rather than
+ * lock all of it, each reactor is a forked copy of the process running
+ * its own poll loop. They share the queue through an anonymous shared
+ * mapping. When its scheduler is about to start a comic, a reactor
+ * claims it with a compare and swap, and skips it if another reactor
+ * got there first. So a reactor that is keeping up takes more of the
+ * queue. Each reactor writes its results, and its source address
+ * counts, back to the mapping and the parent merges them.
+ */
+
+#ifndef _WIN32
+static int me; /* reactor number, from 1 */
+static int *claims; /* reactor that claimed each comic, 0 for none */
+static int *results; /* gotit for each comic */
+
+/* Returns 1 if conn is ours to start */
+int reactor_claim(struct connection *conn)
+{
+	int owner = 0;
+
+	if (!claims || !conn->claim)
+		return 1; /* one reactor, or not a comic */
+
+	return __atomic_compare_exchange_n(&claims[conn->claim - 1], &owner, me,
+					   0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+		owner == me;
+}
+
+static void reactor(int *shared)
+{
+	struct connection *conn;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	/* -t is the total */
+	thread_limit = (thread_limit + reactors - 1) / reactors;
+	sources_share(results + n_comics);
+
+	main_loop();
+
+	for (conn = comics; conn; conn = conn->next)
+		if (conn->claim && claims[conn->claim - 1] == me)
+			results[conn->claim - 1] = conn->gotit;
+	__atomic_add_fetch(shared, resets, __ATOMIC_RELAXED);
+
+	if (verbose)
+		printf("Reactor %d got %d\n", me, gotit);
+	exit(0);
+}
+
+void run_reactors(void)
+{
+	struct connection *conn;
+	size_t size = (2 * n_comics + 1 + sources_shared()) * sizeof(int);
+	int *shared, i = 0, started = 0;
+	pid_t pid;
+
+	if (reactors <= 1 || n_comics <= 1) {
+		main_loop();
+		return;
+	}
+
+	shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		my_perror("mmap");
+		main_loop();
+		return;
+	}
+	claims = shared + 1;
+	results = claims + n_comics;
+
+	for (conn = comics; conn; conn = conn->next)
+		conn->claim = ++i;
+
+	fflush(stdout);
+	for (me = 1; me <= reactors; ++me) {
+		pid = fork();
+		if (pid == 0)
+			reactor(shared);
+		if (pid < 0) {
+			my_perror("fork");
+			break;
+		}
+		++started;
+	}
+	me = 0;
+
+	while (wait(NULL) > 0)
+		;
+
+	if (started == 0) {
+		/* Do it ourselves */
+		munmap(shared, size);
+		claims = results = NULL;
+		main_loop();
+		return;
+	}
+
+	for (conn = comics; conn; conn = conn->next)
+		if (results[conn->claim - 1]) {
+			conn->gotit = 1;
+			++gotit;
+		}
+	resets = *shared;
+	sources_merge(results + n_comics);
+	sources_exit();
+
+	munmap(shared, size);
+	claims = results = NULL;
+}
+#else
+int reactor_claim(struct connection *conn) { return 1; }
+void run_reactors(void) { main_loop(); }
+#endif
@@ -0,0 +1,538 @@
+#include "get-comics.h"
+
+/* Decides when to start the next comic.
+ *
+ * thread_limit is the hard cap. Under it the limit is adjusted AIMD
+ * style. It starts at START_LIMIT and doubles each window (limit
+ * completions) until the first loss, then grows by one per window,
+ * but only while throughput keeps up. A timeout or reset halves it,
+ * at most once a window.
+ *
+ * Each host is also held to host_limit connections. Starts are paced
+ * by a token bucket, one token per pace_ms up to PACE_BURST, so we do
+ * not send a SYN burst. A pace_ms of 0 turns pacing off.
+ *
+ * The queue is the part of the comics list from head on. head_link is
+ * the link to head, so starting a comic does not walk the list. Only
+ * the first LOOKAHEAD queued comics are looked at for one whose host
+ * has room.
+ *
+ * Retries go back on the queue with a time before which they may not
+ * start.
+ *
+ * There are two classes of work: index pages (stage 1) and images
+ * (stage 2). Index fetches are held to index_limit, by default half
+ * the limit, so the rest of the connections go to comics that have
+ * already matched. When a comic matches, its slot moves to the image
+ * host. If that host is full, the comic waits at the front of the
+ * queue, ahead of any new index fetches.
+ *
+ * With hedge_budget set, a transfer that has been on its host longer
+ * than HEDGE_PCT of past runs there gets a duplicate (see hedge.c).
+ * Hosts with no history use the runs finished so far. At most
+ * hedge_budget percent of the comics are hedged.
+ *
+ * With want_preconnect set, starting an index fetch also starts a
+ * connection to the host we expect the image on (see preconnect.c). It
+ * takes a slot on that host, which the comic gets when it matches.
+ */
+
+#define START_LIMIT	8
+#define PACE_MS		10
+#define PACE_BURST	8
+#define LOOKAHEAD	256
+#define HOST_BUCKETS	256
+
+#define HEDGE_PCT		95
+#define HEDGE_MIN_MS	1000 /* never hedge sooner than this */
+#define HEDGE_TICK_MS	100
+#define HEDGE_SAMPLES	64 /* finished runs we remember */
+#define HEDGE_MIN_SAMPLES	8
+
+int host_limit = HOST_LIMIT;
+int index_limit;
+int hedge_budget;
+int pace_ms = PACE_MS;
+
+static int limit;
+static int slow_start = 1;
+static int window_done;
+static int window_cut;
+static off_t window_bytes;
+static double window_start;
+static double last_rate;
+static double tokens = PACE_BURST;
+static double last_refill;
+static int blocked; /* every queued comic is waiting on a busy host */
+static double next_retry; /* or a retry, the first of which is due then */
+static int n_stage1; /* index fetches outstanding */
+
+static long done_ms[HEDGE_SAMPLES];
+static int n_done;
+
+struct sched_host {
+	char *name;
+	int active;
+	long hedge_ms; /* 0 not looked up yet, -1 no history */
+	struct sched_host *next;
+};
+
+static struct sched_host *hosts[HOST_BUCKETS];
+
+static unsigned hash_host(const char *host, int len)
+{	/* FNV-1a */
+	unsigned hash = 2166136261u;
+
+	while (len-- > 0) {
+		hash ^= (unsigned char)*host++;
+		hash *= 16777619;
+	}
+	return hash % HOST_BUCKETS;
+}
+
+static struct sched_host *find_host(const char *url)
+{
+	struct sched_host *host, **bucket;
+	const char *p = is_http((char *)url);
+	int len;
+
+	if (!p)
+		p = url;
+	len = strcspn(p, "/");
+
+	bucket = &hosts[hash_host(p, len)];
+	for (host = *bucket; host; host = host->next)
+		if (strncmp(host->name, p, len) == 0 && host->name[len] == '\0')
+			return host;
+
+	host = must_alloc(sizeof(struct sched_host));
+	host->name = must_alloc(len + 1);
+	memcpy(host->name, p, len);
+	host->next = *bucket;
+	*bucket = host;
+	return host;
+}
+
+/* When conn started on its current host. A two stage comic moves to
+ * the image host when the index page is done. */
+static double host_start(struct connection *conn)
+{
+	return conn->stats.index ? conn->stats.index : conn->stats.start;
+}
+
+static int host_ok(struct connection *conn)
+{
+	return host_limit <= 0 || find_host(conn->url)->active < host_limit;
+}
+
+static int retry_ok(struct connection *conn, double t)
+{
+	if (conn->retry_at <= t)
+		return 1;
+	if (next_retry == 0 || conn->retry_at < next_retry)
+		next_retry = conn->retry_at;
+	return 0;
+}
+
+#ifndef WANT_CURL
+static void sched_preconnect(struct connection *conn);
+#endif
+
+static int is_stage1(struct connection *conn)
+{
+	return conn->regexp && !conn->matched;
+}
+
+static int stage1_ok(struct connection *conn)
+{
+	int max = index_limit > 0 ? index_limit : limit / 2;
+
+	return !is_stage1(conn) || n_stage1 < (max > 0 ? max : 1);
+}
+
+/* Comics to go back on the queue. The main loop may be walking the
+ * comics when one is queued, so they are moved in sched_requeue(). */
+static struct connection **requeued;
+static int n_requeued, max_requeued;
+
+void sched_queue(struct connection *conn)
+{
+	if (n_requeued == max_requeued) {
+		max_requeued += 16;
+		requeued = realloc(requeued, max_requeued * sizeof(*requeued));
+		if (!requeued) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+	requeued[n_requeued++] = conn;
+}
+
+static struct connection **head_link = &comics;
+
+/* Connections are never freed and extra ones (hedges, pre-connects)
+ * are only added after their owner, so the last link is usually still
+ * before head. */
+static struct connection **find_head_link(void)
+{
+	struct connection **link = head_link;
+
+	while (*link != head)
+		if (*link)
+			link = &(*link)->next;
+		else
+			link = &comics; /* it was moved past head */
+	return head_link = link;
+}
+
+static int is_requeued(struct connection *conn)
+{
+	int i;
+
+	for (i = 0; i < n_requeued; ++i)
+		if (requeued[i] == conn)
+			return 1;
+	return 0;
+}
+
+/* Queue the comics ahead of the ones not started yet. Only when
+ * nobody is walking the comics. */
+void sched_requeue(void)
+{
+	struct connection **prev = &comics, *conn;
+	int i;
+
+	if (n_requeued == 0)
+		return;
+
+	/* Take the ones already started out, in one pass */
+	while (*prev != head)
+		if (is_requeued(*prev))
+			*prev = (*prev)->next;
+		else
+			prev = &(*prev)->next;
+
+	for (i = 0; i < n_requeued; ++i) {
+		conn = requeued[i];
+		conn->next = head;
+		*prev = head = conn;
+	}
+	head_link = prev;
+	n_requeued = 0;
+}
+
+void sched_retry(struct connection *conn, double delay)
+{
+	conn->retry_at = now() + delay;
+	sched_queue(conn);
+}
+
+/* Move conn to the front of the queue */
+static void to_head(struct connection **prev)
+{
+	struct connection **link, *conn = *prev;
+
+	if (conn == head)
+		return;
+
+	link = find_head_link();
+	*prev = conn->next;
+	conn->next = head;
+	*link = head = conn;
+}
+
+/* Returns 1 if pacing lets us start one now */
+static int pace_ok(double t)
+{
+	if (pace_ms <= 0)
+		return 1;
+
+	tokens += (t - last_refill) * 1000 / pace_ms;
+	if (tokens > PACE_BURST)
+		tokens = PACE_BURST;
+	last_refill = t;
+	return tokens >= 1;
+}
+
+int start_next_comic(void)
+{
+	struct connection **prev, *conn;
+	double t = now();
+	int n, rc;
+
+	if (limit == 0) {
+		limit = thread_limit < START_LIMIT ? thread_limit : START_LIMIT;
+		window_start = t;
+	}
+
+	sched_requeue();
+
+	blocked = 0;
+	next_retry = 0;
+	while (head && outstanding < limit) {
+		if (!pace_ok(t))
+			return 1;
+
+		/* First queued comic whose host has room */
+		for (prev = &head, n = 0; *prev && n < LOOKAHEAD;
+			 prev = &(*prev)->next, ++n)
+			if (retry_ok(*prev, t) && host_ok(*prev) && stage1_ok(*prev))
+				break;
+		if (!*prev || n == LOOKAHEAD) {
+			blocked = 1;
+			return 1;
+		}
+		to_head(prev);
+
+		conn = head;
+		head_link = &conn->next;
+#ifndef WANT_CURL
+		if (!reactor_claim(conn)) {
+			/* Another reactor has it */
+			head = head->next;
+			continue;
+		}
+#endif
+		rc = start_one_comic(conn);
+		head = head->next;
+		if (rc) {
+			conn->shost = find_host(conn->url);
+			++conn->shost->active;
+			if (is_stage1(conn)) {
+				conn->stage1 = 1;
+				++n_stage1;
+#ifndef WANT_CURL
+				sched_preconnect(conn);
+#endif
+			}
+			if (pace_ms > 0)
+				--tokens;
+			return rc;
+		}
+	}
+
+	return head != NULL;
+}
+
+/* How long the main loop may wait before we want to start another */
+int sched_timeout(int timeout)
+{
+	int wait;
+
+	if (!head || outstanding >= limit)
+		return timeout;
+
+	if (blocked) {
+		if (next_retry == 0)
+			return timeout;
+		wait = (int)((next_retry - now()) * 1000) + 1;
+	} else if (pace_ok(now()))
+		wait = 0;
+	else
+		wait = (int)((1 - tokens) * pace_ms) + 1;
+	if (wait < 0)
+		wait = 0;
+	return wait < timeout ? wait : timeout;
+}
+
+static void end_window(double t)
+{
+	double rate = t > window_start ? window_bytes / (t - window_start) : 0;
+
+	if (!window_cut && rate >= last_rate * 0.95 && limit < thread_limit) {
+		limit = slow_start ? limit * 2 : limit + 1;
+		if (limit > thread_limit)
+			limit = thread_limit;
+		if (verbose > 1)
+			printf("Limit %d (%.0f bytes/sec)\n", limit, rate);
+	}
+
+	last_rate = rate;
+	window_start = t;
+	window_done = 0;
+	window_bytes = 0;
+	window_cut = 0;
+}
+
+/* Called for every started connection when it closes or fails */
+void sched_done(struct connection *conn)
+{
+#ifndef WANT_CURL
+	if (conn->warm && !conn->is_warm)
+		drop_preconnect(conn->warm);
+#endif
+	if (!conn->shost)
+		return;
+
+	--conn->shost->active;
+	conn->shost = NULL;
+	if (conn->is_warm)
+		return; /* not a transfer */
+	if (conn->stage1) {
+		conn->stage1 = 0;
+		--n_stage1;
+	}
+
+	if (conn->gotit && !conn->is_hedge)
+		done_ms[n_done++ % HEDGE_SAMPLES] =
+			(long)((now() - host_start(conn)) * 1000);
+
+	window_bytes += conn->written;
+	if (++window_done >= limit)
+		end_window(now());
+}
+
+/* The comic matched and conn->url is now the image. Returns 1 if it
+ * was queued to wait for room on the image host. */
+int sched_stage2(struct connection *conn)
+{
+	struct sched_host *host;
+
+	if (!conn->shost)
+		return 0; /* not ours, e.g. the threaded curl */
+
+	if (conn->stage1) {
+		conn->stage1 = 0;
+		--n_stage1;
+	}
+
+	host = find_host(conn->url);
+	if (host == conn->shost)
+		return 0;
+
+	if (conn->warm && conn->warm->shost == host) {
+		/* The pre-connect hands over its slot */
+		conn->warm->shost = NULL;
+		--host->active;
+	}
+
+	--conn->shost->active;
+	if (host_limit <= 0 || host->active < host_limit) {
+		conn->shost = host;
+		++host->active;
+		return 0;
+	}
+
+	if (verbose > 1)
+		printf("Queued %s\n", conn->url);
+	conn->shost = NULL;
+	release_connection(conn);
+	--outstanding;
+	sched_queue(conn);
+	return 1;
+}
+
+/* A timeout or reset */
+void sched_loss(void)
+{
+	if (window_cut)
+		return;
+
+	window_cut = 1;
+	slow_start = 0;
+	limit /= 2;
+	if (limit < 1)
+		limit = 1;
+	if (verbose > 1)
+		printf("Limit %d (loss)\n", limit);
+}
+
+int max_hedges(void)
+{
+	return (n_comics * hedge_budget + 99) / 100;
+}
+
+#ifndef WANT_CURL
+static int hedges;
+static double last_hedge;
+
+static int cmp_ms(const void *a, const void *b)
+{
+	long la = *(const long *)a, lb = *(const long *)b;
+	return la < lb ? -1 : la > lb;
+}
+
+/* HEDGE_PCT of the runs finished so far, -1 if too few */
+static long run_percentile(void)
+{
+	long sorted[HEDGE_SAMPLES];
+	int n = n_done < HEDGE_SAMPLES ? n_done : HEDGE_SAMPLES;
+
+	if (n < HEDGE_MIN_SAMPLES)
+		return -1;
+
+	memcpy(sorted, done_ms, n * sizeof(long));
+	qsort(sorted, n, sizeof(long), cmp_ms);
+	return sorted[(n * HEDGE_PCT + 99) / 100 - 1];
+}
+
+static long hedge_after(struct sched_host *host, long run_ms)
+{
+	long ms;
+
+	if (host->hedge_ms == 0) {
+		host->hedge_ms = stats_percentile(host->name, HEDGE_PCT);
+		if (host->hedge_ms == 0)
+			host->hedge_ms = 1;
+	}
+
+	ms = host->hedge_ms > 0 ? host->hedge_ms : run_ms;
+	if (ms < 0)
+		return -1;
+	return ms < HEDGE_MIN_MS ? HEDGE_MIN_MS : ms;
+}
+
+/* Called from the main loop */
+void sched_hedge(void)
+{
+	struct connection *conn, *dup;
+	double t = now();
+	long run_ms, after;
+
+	if (!hedge_budget || hedges >= max_hedges() ||
+		t - last_hedge < HEDGE_TICK_MS / 1000.0)
+		return;
+	last_hedge = t;
+
+	run_ms = run_percentile();
+	for (conn = comics; conn != head; conn = conn->next) {
+		if (hedges >= max_hedges() || outstanding >= limit)
+			return;
+		if (!conn->shost || !want_hedge(conn) || !host_ok(conn))
+			continue;
+
+		after = hedge_after(conn->shost, run_ms);
+		if (after < 0 || (t - host_start(conn)) * 1000 < after)
+			continue;
+
+		dup = start_hedge(conn);
+		if (dup) {
+			dup->shost = conn->shost;
+			++dup->shost->active;
+			++hedges;
+		}
+	}
+}
+
+/* Warm up a connection to where conn's image probably is */
+static void sched_preconnect(struct connection *conn)
+{
+	struct connection *warm;
+	struct sched_host *host;
+	char url[256];
+
+	if (!want_preconnect || outstanding >= limit ||
+		predict_host(conn, url, sizeof(url)))
+		return;
+
+	host = find_host(url);
+	if (host_limit > 0 && host->active >= host_limit)
+		return;
+
+	warm = start_preconnect(conn, url);
+	if (warm) {
+		warm->shost = host;
+		++host->active;
+	}
+}
+#endif
@@ -0,0 +1,211 @@
+#include "get-comics.h"
+
+/* Segmented downloads for http-get (-S).
+ *
+ * The first request is a probe for the first SEG_PROBE bytes. If the
+ * server answers with a 206 we know the total size and roughly how
+ * fast one connection is. If the rest is big enough it is split into
+ * up to max_segments range requests, each a connection of its own,
+ * that pwrite into the preallocated output file. The parent gives up
+ * its socket and its scheduler slot, and waits until all of its
+ * segments are done.
+ *
+ * Segments resume from where they left off if they are reset.
+ */
+
+#define SEG_PROBE	(64 * 1024)
+/* Smallest segment worth a connection */
+#define SEG_MIN		(1024 * 1024)
+/* Do not split if one connection would finish the rest in this time */
+#define SEG_SECS	1.0
+
+#ifndef _WIN32
+int want_segments(struct connection *conn)
+{
+	if (conn->parent)
+		return 1;
+
+	/* Only probe on the first try of the final stage */
+	return max_segments && *method == 'G' && !conn->reset && !conn->is_hedge &&
+		!(conn->regexp && !conn->matched);
+}
+
+/* Add the Range header to the request */
+void segment_request(struct connection *conn)
+{
+	char *p = conn->buf + strlen(conn->buf);
+
+	if (conn->parent) {
+		p += sprintf(p, "Range: bytes=%lld-%lld\r\n",
+			     (long long)conn->offset, (long long)conn->range_end);
+		if (conn->parent->etag && strncmp(conn->parent->etag, "W/", 2))
+			sprintf(p, "If-Range: %.200s\r\n", conn->parent->etag);
+		else if (conn->parent->lastmod)
+			sprintf(p, "If-Range: %.100s\r\n", conn->parent->lastmod);
+		return;
+	}
+
+	conn->offset = conn->range_start = 0;
+	conn->range_end = SEG_PROBE - 1;
+	sprintf(p, "Range: bytes=0-%d\r\n", SEG_PROBE - 1);
+	conn->started = now();
+}
+
+static int pick_segments(struct connection *conn, off_t rest)
+{
+	double secs = now() - conn->started;
+	off_t n;
+
+	if (secs > 0 && conn->written / secs * SEG_SECS >= rest)
+		return 1;
+
+	n = rest / SEG_MIN;
+	if (n > max_segments)
+		n = max_segments;
+	return n > 0 ? n : 1;
+}
+
+/* Called when the probe is done. Returns 0 if we split. */
+int split_connection(struct connection *conn)
+{
+	off_t rest = conn->total - conn->written, start, size;
+	char *tmpname;
+	int i, n, out, err;
+
+	conn->range_end = 0;
+	if (rest <= 0 || conn->out < 0)
+		return 1;
+
+	n = pick_segments(conn, rest);
+
+	err = posix_fallocate(conn->out, 0, conn->total);
+	if (err && ftruncate(conn->out, conn->total)) {
+		my_perror(conn->tmpname);
+		return 1;
+	}
+
+	if (verbose)
+		printf("Split %s into %d segments\n", conn->url, n);
+
+	/* Done with the socket but not the output */
+	out = conn->out;
+	tmpname = conn->tmpname;
+	conn->out = -1;
+	conn->tmpname = NULL;
+	release_connection(conn);
+	conn->out = out;
+	conn->tmpname = tmpname;
+
+	/* The segments need the slots. Parents waiting on a full host
+	 * would never let them start. */
+	--outstanding;
+	sched_done(conn);
+
+	/* Out of order writes cannot be hashed */
+	conn->hashing = 0;
+	conn->hash = 0;
+
+	size = rest / n;
+	start = conn->written;
+	for (i = n - 1; i >= 0; --i) {
+		struct connection *seg = must_alloc(sizeof(struct connection));
+
+		seg->out = -1;
+		seg->gotit = 1; /* not a comic, keep out of out_results */
+		seg->url = must_strdup(conn->url);
+		seg->host = must_strdup(conn->host);
+		seg->parent = conn;
+		seg->range_start = start + i * size;
+		seg->range_end = i == n - 1 ?
+			conn->total - 1 : seg->range_start + size - 1;
+		seg->offset = seg->range_start;
+		sched_queue(seg);
+	}
+	conn->pending = n;
+
+	return 0;
+}
+
+/* The parent is done when the last segment is */
+static void segment_done(struct connection *conn, int ok)
+{
+	struct connection *parent = conn->parent;
+
+	if (!ok)
+		parent->failed = 1;
+	if (parent->pending > 1) {
+		--parent->pending;
+		return;
+	}
+
+	++outstanding; /* given up in split_connection */
+	if (parent->failed)
+		fail_connection(parent);
+	else
+		close_connection(parent);
+}
+
+int close_segment(struct connection *conn, int ok)
+{
+	if (!CONN_OPEN) {
+		printf("Multiple Closes: %s\n", conn->url);
+		return 0;
+	}
+
+	--outstanding;
+	sched_done(conn);
+	if (conn->offset != conn->range_end + 1)
+		ok = 0;
+	if (verbose > 1)
+		printf("%s segment %lld-%lld of %s (%d)\n",
+		       ok ? "Closed" : "Failed",
+		       (long long)conn->range_start, (long long)conn->range_end,
+		       conn->url, outstanding);
+	release_connection(conn);
+
+	segment_done(conn, ok);
+	return 0;
+}
+
+/* A segment that could not be started was never counted */
+void fail_segment_start(struct connection *conn)
+{
+	if (verbose > 1)
+		printf("Failed to start segment %lld-%lld of %s\n",
+		       (long long)conn->range_start, (long long)conn->range_end,
+		       conn->url);
+	release_connection(conn);
+	segment_done(conn, 0);
+}
+
+int write_segment(struct connection *conn, char *buf, int bytes)
+{
+	int n;
+
+	if (conn->offset + bytes > conn->range_end + 1) {
+		printf("%s: segment overrun\n", conn->url);
+		return 0;
+	}
+
+	n = pwrite(conn->parent->out, buf, bytes, conn->offset);
+	if (n != bytes) {
+		if (n < 0)
+			printf("%s: Write error: %s\n",
+			       conn->parent->tmpname, strerror(errno));
+		else
+			printf("%s: Write error: %d/%d\n",
+			       conn->parent->tmpname, n, bytes);
+		return 0;
+	}
+
+	conn->offset += n;
+	return bytes;
+}
+#else
+int want_segments(struct connection *conn) { return 0; }
+void segment_request(struct connection *conn) {}
+int split_connection(struct connection *conn) { return 1; }
+int close_segment(struct connection *conn, int ok) { return 0; }
+void fail_segment_start(struct connection *conn) {}
+int write_segment(struct connection *conn, char *buf, int bytes) { return 0; }
+#endif
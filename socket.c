@@ -15,9 +15,46 @@
 /* Non-IPV4 only. We currently get about 78% cache hits! */
 #define USE_CACHE
 
+/* TCP Fast Open (the fastopen config key). Plain http GETs set
+ * TCP_FASTOPEN_CONNECT so the request goes in the SYN if the kernel has
+ * a cookie for the server. Without one the kernel sends a plain SYN and
+ * asks for a cookie, and the request goes after the handshake. We give
+ * up on a host after TFO_TRIES connections without the data in the SYN
+ * being acked. */
+#define TFO_TRIES	3
+
+struct tfo_host {
+	char *name;
+	int tries;
+	int acked; /* SYN data acked */
+	struct tfo_host *next;
+};
+
+static struct tfo_host *tfo_hosts;
+
+/* Source addresses (link-check -b). New sockets are bound round robin
+ * across them. With IP_BIND_ADDRESS_NO_PORT the port is not picked
+ * until connect(), so each address gets a full ephemeral port range
+ * per destination rather than one range shared by all. */
+struct source {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	char *name;
+	int used;
+	int failed;
+	struct source *next;
+};
+
+static struct source *sources, *last_source;
+static int n_sources;
+/* With -j the reactors add their counts here and the parent prints */
+static int *shared_counts;
+
 
 static int tcp_connected(struct connection *conn)
 {
+	stats_mark(&conn->stats.connect);
+
 #ifdef WANT_SSL
 	if (is_https(conn->url)) {
 		if (openssl_connect(conn)) {
@@ -58,13 +95,171 @@ static inline int inprogress(void)
 #endif
 }
 
+static struct tfo_host *tfo_host(struct connection *conn, char *hostname)
+{
+	struct tfo_host *h;
+
+	if (!want_fastopen || conn->is_warm || is_https(conn->url) ||
+		(*method != 'G' && *method != 'H'))
+		return NULL;
+
+	for (h = tfo_hosts; h; h = h->next)
+		if (strcmp(h->name, hostname) == 0)
+			break;
+	if (!h) {
+		h = must_alloc(sizeof(struct tfo_host));
+		h->name = must_strdup(hostname);
+		h->next = tfo_hosts;
+		tfo_hosts = h;
+	}
+
+	return h->tries >= TFO_TRIES && h->acked == 0 ? NULL : h;
+}
+
+/* Called with the reply. Did the request make it in the SYN? */
+void fastopen_check(struct connection *conn)
+{
+#ifdef TCPI_OPT_SYN_DATA
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(conn->poll->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+		(info.tcpi_options & TCPI_OPT_SYN_DATA)) {
+		++conn->tfo->acked;
+		if (verbose > 1)
+			printf("Fast open %s\n", conn->url);
+	}
+#endif
+	conn->tfo = NULL;
+}
+
+void fastopen_exit(void)
+{
+	while (tfo_hosts) {
+		struct tfo_host *next = tfo_hosts->next;
+
+		if (verbose)
+			printf("Fast open %s: %d of %d\n", tfo_hosts->name,
+				   tfo_hosts->acked, tfo_hosts->tries);
+		free(tfo_hosts->name);
+		free(tfo_hosts);
+		tfo_hosts = next;
+	}
+}
+
+int add_source(const char *addr)
+{
+	struct source *s = must_alloc(sizeof(struct source)), **tail;
+	struct sockaddr_in *in = (struct sockaddr_in *)&s->addr;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&s->addr;
+
+	if (inet_pton(AF_INET, addr, &in->sin_addr) == 1) {
+		in->sin_family = AF_INET;
+		s->len = sizeof(struct sockaddr_in);
+	} else if (inet_pton(AF_INET6, addr, &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		s->len = sizeof(struct sockaddr_in6);
+	} else {
+		printf("Bad source address %s\n", addr);
+		free(s);
+		return 1;
+	}
+	s->name = must_strdup(addr);
+
+	for (tail = &sources; *tail; tail = &(*tail)->next)
+		;
+	*tail = s;
+	++n_sources;
+	return 0;
+}
+
+/* Bind sock to the next source of the right family, if we have one */
+static int bind_source(int sock, int family)
+{
+	struct source *s = last_source;
+	int i, flags = 1;
+
+	for (i = 0; i < n_sources; ++i) {
+		s = s && s->next ? s->next : sources;
+		if (s->addr.ss_family == family)
+			break;
+	}
+	if (i == n_sources)
+		return 0; /* none of this family */
+	last_source = s;
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+	if (family == AF_INET)
+		setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+				   &flags, sizeof(flags));
+#endif
+	if (bind(sock, (struct sockaddr *)&s->addr, s->len)) {
+		++s->failed;
+		if (verbose)
+			my_perror(s->name);
+		return -1;
+	}
+
+	++s->used;
+	return 0;
+}
+
+/* Number of ints sources_share() needs */
+int sources_shared(void)
+{
+	return 2 * n_sources;
+}
+
+/* In a reactor, add the counts to the shared ones rather than print */
+void sources_share(int *counts)
+{
+	shared_counts = counts;
+}
+
+/* In the parent, once the reactors are done */
+void sources_merge(const int *counts)
+{
+	struct source *s;
+
+	for (s = sources; s; s = s->next) {
+		s->used += *counts++;
+		s->failed += *counts++;
+	}
+}
+
+void sources_exit(void)
+{
+	int *counts = shared_counts;
+
+	while (sources) {
+		struct source *next = sources->next;
+
+		if (counts) {
+			__atomic_add_fetch(counts++, sources->used, __ATOMIC_RELAXED);
+			__atomic_add_fetch(counts++, sources->failed, __ATOMIC_RELAXED);
+		} else {
+			printf("Source %s: %d connects", sources->name, sources->used);
+			if (sources->failed)
+				printf(" (%d failed)", sources->failed);
+			putchar('\n');
+		}
+		free(sources->name);
+		free(sources);
+		sources = next;
+	}
+	shared_counts = NULL;
+	last_source = NULL;
+	n_sources = 0;
+}
+
 #ifdef IPV4
 int connect_socket(struct connection *conn, char *hostname, char *port_in)
 {
 	struct sockaddr_in sock_name;
-	int sock;
+	int sock, flags = 1;
 	struct hostent *host;
 	int port = strtol(port_in, NULL, 10);
+	struct tfo_host *tfo = tfo_host(conn, hostname);
 
 	host = gethostbyname(hostname);
 	if (!host) {
@@ -78,6 +273,19 @@ int connect_socket(struct connection *conn, char *hostname, char *port_in)
 		return -1;
 	}
 
+	if (bind_source(sock, AF_INET))
+		goto failed;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+
+#ifdef TCP_FASTOPEN_CONNECT
+	if (tfo &&
+		setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &flags, sizeof(flags)))
+		tfo = NULL;
+#else
+	tfo = NULL;
+#endif
+
 	if (set_non_blocking(sock))
 		goto failed;
 
@@ -86,6 +294,10 @@ int connect_socket(struct connection *conn, char *hostname, char *port_in)
 		goto failed;
 	}
 
+	conn->tfo = tfo;
+	if (tfo)
+		++tfo->tries;
+
 	memset(&sock_name, 0, sizeof(sock_name));
 	sock_name.sin_family = AF_INET;
 	sock_name.sin_addr.s_addr = *(unsigned *)host->h_addr_list[0];
@@ -185,15 +397,29 @@ void free_cache(void)
 #endif
 }
 
-static int try_connect(struct addrinfo *r, int *deferred)
+static int try_connect(struct addrinfo *r, int *deferred, int *fastopen)
 {
 	int sock = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
 	if (sock < 0)
 		return -1;
 
+	if (bind_source(sock, r->ai_family)) {
+		closesocket(sock);
+		return -1;
+	}
+
 	int flags = 1;
 	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
 
+#ifdef TCP_FASTOPEN_CONNECT
+	/* connect() returns at once, the SYN goes with the first send */
+	if (*fastopen &&
+		setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &flags, sizeof(flags)))
+		*fastopen = 0;
+#else
+	*fastopen = 0;
+#endif
+
 	if (set_non_blocking(sock)) {
 		closesocket(sock);
 		return -1;
@@ -220,10 +446,12 @@ int connect_socket(struct connection *conn, char *hostname, char *port)
 {
 	int sock = -1, deferred;
 	struct addrinfo hints, *result, *r;
+	struct tfo_host *tfo = tfo_host(conn, hostname);
+	int fastopen = tfo != NULL;
 
 	r = get_cache(hostname, port);
 	if (r)
-		sock = try_connect(r, &deferred);
+		sock = try_connect(r, &deferred, &fastopen);
 
 	if (sock < 0) {
 		/* We need this or we will get tcp and udp */
@@ -236,7 +464,7 @@ int connect_socket(struct connection *conn, char *hostname, char *port)
 		}
 
 		for (r = result; r; r = r->ai_next) {
-			sock = try_connect(r, &deferred);
+			sock = try_connect(r, &deferred, &fastopen);
 			if (sock >= 0)
 				break;
 		}
@@ -257,6 +485,10 @@ int connect_socket(struct connection *conn, char *hostname, char *port)
 		return -1;
 	}
 
+	conn->tfo = fastopen ? tfo : NULL;
+	if (conn->tfo)
+		++tfo->tries;
+
 	if (deferred)
 		return 0;
 	else
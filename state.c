@@ -0,0 +1,271 @@
+#include "get-comics.h"
+#include <limits.h>
+
+/* State kept between runs. It all lives in one directory, the
+ * state_dir, which is off (NULL) by default.
+ *
+ * The validators file keeps the ETag and Last-Modified for each url
+ * we downloaded, and the file it went to, so we can send conditional
+ * GETs. Two comics can fetch the same url into different files, so
+ * there is one line per url and file, tab separated:
+ *
+ *     seen url etag last-modified fname hash
+ *
+ * Empty fields are stored as "-". The hash is the store hash, see
+ * store.c, or 0.
+ */
+
+char *state_dir;
+
+#define VALIDATORS		"validators"
+/* Forget urls we have not seen in this long */
+#define VALIDATOR_AGE	(30 * 24 * 60 * 60)
+#define N_BUCKETS		1024
+
+static struct validator *buckets[N_BUCKETS];
+static int dirty;
+
+#ifndef WIN32
+/* mkdir -p */
+static int make_dirs(const char *dir)
+{
+	char path[PATH_MAX], *p;
+
+	snprintf(path, sizeof(path), "%s", dir);
+	for (p = path + 1; *p; ++p)
+		if (*p == '/') {
+			*p = '\0';
+			if (mkdir(path, 0775) && errno != EEXIST)
+				return 1;
+			*p = '/';
+		}
+
+	return mkdir(path, 0775) && errno != EEXIST;
+}
+#endif
+
+/* Because we cd to the comics dir this must be absolute. */
+void set_state_dir(const char *dir)
+{
+	free(state_dir);
+#ifdef WIN32
+	state_dir = must_strdup(dir);
+#else
+	if (access(dir, F_OK) && make_dirs(dir)) {
+		my_perror(dir);
+		exit(1);
+	}
+
+	if (!(state_dir = realpath(dir, NULL))) {
+		my_perror(dir);
+		exit(1);
+	}
+#endif
+}
+
+char *state_path(const char *name, char *path, int len)
+{
+	snprintf(path, len, "%s/%s", state_dir, name);
+	return path;
+}
+
+static unsigned hash_str(const char *str)
+{	/* FNV-1a */
+	unsigned hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619;
+	}
+	return hash % N_BUCKETS;
+}
+
+/* Only the extension of fname can differ */
+static struct validator *find_url(const char *url, const char *fname)
+{
+	struct validator *v;
+	int len = strlen(fname);
+
+	for (v = buckets[hash_str(url)]; v; v = v->next)
+		if (strcmp(v->url, url) == 0 &&
+			strncmp(v->fname, fname, len) == 0 && strlen(v->fname + len) <= 4)
+			return v;
+	return NULL;
+}
+
+static char *field(char *str)
+{
+	return strcmp(str, "-") ? must_strdup(str) : NULL;
+}
+
+static void validators_load(void)
+{
+	char path[PATH_MAX], line[4096];
+	time_t old = time(NULL) - VALIDATOR_AGE;
+	FILE *fp;
+
+	if (!state_dir)
+		return;
+
+	fp = fopen(state_path(VALIDATORS, path, sizeof(path)), "r");
+	if (!fp)
+		return; /* first run */
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *f[6], *p = line;
+		int i;
+
+		for (i = 0; i < 6; ++i) {
+			f[i] = strsep(&p, "\t\n");
+			if (!f[i] || !*f[i])
+				break;
+		}
+		if (i < 5) { /* the hash is optional */
+			printf("%s: bad line\n", path);
+			continue;
+		}
+
+		time_t seen = strtol(f[0], NULL, 10);
+		if (seen < old) {
+			dirty = 1;
+			continue;
+		}
+
+		struct validator *v = must_alloc(sizeof(struct validator));
+		v->seen = seen;
+		v->url = must_strdup(f[1]);
+		v->etag = field(f[2]);
+		v->lastmod = field(f[3]);
+		v->fname = must_strdup(f[4]);
+		v->hash = i == 6 ? strtoull(f[5], NULL, 16) : 0;
+
+		unsigned hash = hash_str(v->url);
+		v->next = buckets[hash];
+		buckets[hash] = v;
+	}
+
+	fclose(fp);
+}
+
+static void free_validator(struct validator *v)
+{
+	free(v->url);
+	free(v->etag);
+	free(v->lastmod);
+	free(v->fname);
+	free(v);
+}
+
+static void validators_save(void)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct validator *v;
+	FILE *fp;
+	int i;
+
+	if (!state_dir || !dirty)
+		goto done;
+
+	state_path(VALIDATORS ".tmp", tmp, sizeof(tmp));
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		my_perror(tmp);
+		goto done;
+	}
+
+	for (i = 0; i < N_BUCKETS; ++i)
+		for (v = buckets[i]; v; v = v->next)
+			fprintf(fp, "%ld\t%s\t%s\t%s\t%s\t%llx\n",
+					(long)v->seen, v->url,
+					v->etag ? v->etag : "-",
+					v->lastmod ? v->lastmod : "-", v->fname,
+					(unsigned long long)v->hash);
+
+	if (fclose(fp) || rename(tmp, state_path(VALIDATORS, path, sizeof(path))))
+		my_perror(path);
+
+done:
+	for (i = 0; i < N_BUCKETS; ++i)
+		while (buckets[i]) {
+			v = buckets[i]->next;
+			free_validator(buckets[i]);
+			buckets[i] = v;
+		}
+}
+
+/* Returns the validator for this request only if the file it
+ * describes is still there, or can be linked from the store. fname
+ * is the name we are about to write: the index file or the output
+ * name without the extension. */
+struct validator *find_validator(struct connection *conn, const char *fname)
+{
+	struct validator *v;
+
+	if (!state_dir || !fname || *method == 'H')
+		return NULL;
+
+	v = find_url(conn->url, fname);
+	if (!v)
+		return NULL;
+
+	if (access(v->fname, F_OK) && !store_has(v->hash, v->fname))
+		return NULL;
+
+	return v;
+}
+
+/* Called once the file is complete */
+void update_validator(struct connection *conn, const char *fname)
+{
+	struct validator *v;
+
+	if (!state_dir || !fname)
+		return;
+
+	if (!conn->etag && !conn->lastmod) {
+		/* A 304 may not resend the validators */
+		if (conn->validator) {
+			conn->validator->seen = time(NULL);
+			dirty = 1;
+		}
+		return;
+	}
+
+	/* The one we sent, even if the extension changed */
+	v = conn->validator;
+	if (!v)
+		v = find_url(conn->url, fname);
+	if (v) {
+		free(v->etag);
+		free(v->lastmod);
+		free(v->fname);
+	} else {
+		unsigned hash = hash_str(conn->url);
+		v = must_alloc(sizeof(struct validator));
+		v->url = must_strdup(conn->url);
+		v->next = buckets[hash];
+		buckets[hash] = v;
+	}
+
+	v->etag = conn->etag;
+	v->lastmod = conn->lastmod;
+	v->fname = must_strdup(fname);
+	v->hash = conn->hash;
+	v->seen = time(NULL);
+	conn->etag = conn->lastmod = NULL;
+	dirty = 1;
+}
+
+void state_init(void)
+{
+	validators_load();
+	store_init();
+}
+
+void state_exit(void)
+{
+	validators_save();
+	store_exit();
+	free(state_dir);
+	state_dir = NULL;
+}
@@ -0,0 +1,394 @@
+#include "get-comics.h"
+#include <limits.h>
+
+/* Per comic statistics, appended to state_dir/stats after each run.
+ * One line per comic, tab separated:
+ *
+ *     when name host status connect reply index total bytes match reason
+ *     index-host
+ *
+ * when is the start of the run. host is where the comic came from,
+ * index-host is the host of the config url. They only differ for two
+ * stage comics. connect, reply, index and total are milliseconds from
+ * the start of the comic, -1 if it never got there. reply is the first
+ * reply header, index is when the index page was processed. match is
+ * the offset of the regexp match in the index page. reason is "-" if
+ * we got the comic. Older files do not have index-host.
+ */
+
+#define STATS		"stats"
+#define STATS_FIELDS	12
+
+static time_t run_start;
+
+void stats_start(struct connection *conn)
+{
+	stats_mark(&conn->stats.start);
+	if (!conn->stats.index_host)
+		conn->stats.index_host = must_strdup(conn->host ? conn->host : conn->url);
+}
+
+void stats_mark(double *when)
+{
+	if (*when == 0)
+		*when = now();
+}
+
+void stats_fail(struct connection *conn, const char *reason)
+{
+	if (!conn->stats.reason)
+		conn->stats.reason = reason;
+}
+
+static long ms(struct connection *conn, double when)
+{
+	return when ? (long)((when - conn->stats.start) * 1000) : -1;
+}
+
+/* The comic name is the output name without the extension */
+static void stats_name(struct connection *conn, char *name, int len)
+{
+	char *p;
+
+	snprintf(name, len, "%s", conn->outname ? conn->outname : conn->url);
+	p = strrchr(name, '.');
+	if (p && is_imgtype(p))
+		*p = '\0';
+}
+
+/* host without the scheme. It may have a path after it. */
+static const char *bare_host(char *host)
+{
+	char *p = is_http(host);
+
+	return p ? p : host;
+}
+
+static const char *stats_host(struct connection *conn)
+{
+	return bare_host(conn->host ? conn->host : conn->url);
+}
+
+/* History */
+
+struct record {
+	char *name;
+	char *host;
+	char *index_host;
+	long index;
+	long total;
+	int failed;
+};
+
+static struct record *records;
+static int n_records;
+
+static int cmp_name(const void *a, const void *b)
+{
+	const struct record *ra = a, *rb = b;
+	return strcmp(ra->name, rb->name);
+}
+
+static int cmp_host(const void *a, const void *b)
+{
+	const struct record *ra = a, *rb = b;
+	return strcmp(ra->host, rb->host);
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long la = *(const long *)a, lb = *(const long *)b;
+	return la < lb ? -1 : la > lb;
+}
+
+static int load_records(int days)
+{
+	char path[PATH_MAX], line[1024];
+	time_t old = time(NULL) - days * 24 * 60 * 60;
+	int size = 0;
+	FILE *fp;
+
+	fp = fopen(state_path(STATS, path, sizeof(path)), "r");
+	if (!fp) {
+		if (errno != ENOENT)
+			my_perror(path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *f[STATS_FIELDS], *p = line;
+		int i;
+
+		for (i = 0; i < STATS_FIELDS; ++i)
+			if (!(f[i] = strsep(&p, "\t\n")))
+				break;
+		if (i < STATS_FIELDS - 1 || strtol(f[0], NULL, 10) < old)
+			continue;
+
+		if (n_records == size) {
+			size += 1024;
+			records = realloc(records, size * sizeof(struct record));
+			if (!records) {
+				printf("OUT OF MEMORY\n");
+				exit(1);
+			}
+		}
+
+		records[n_records].name = must_strdup(f[1]);
+		records[n_records].host = must_strdup(f[2]);
+		records[n_records].index_host = must_strdup(i == STATS_FIELDS && *f[11] ? f[11] : f[2]);
+		records[n_records].index = strtol(f[6], NULL, 10);
+		records[n_records].total = strtol(f[7], NULL, 10);
+		records[n_records].failed = strcmp(f[10], "-") != 0;
+		++n_records;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static void free_records(void)
+{
+	int i;
+
+	for (i = 0; i < n_records; ++i) {
+		free(records[i].name);
+		free(records[i].host);
+		free(records[i].index_host);
+	}
+	free(records);
+	records = NULL;
+	n_records = 0;
+}
+
+void stats_init(void)
+{
+	run_start = time(NULL);
+	if (state_dir)
+		load_records(STATS_DAYS);
+}
+
+void stats_save(void)
+{
+	char path[PATH_MAX], name[128];
+	struct connection *conn;
+	FILE *fp;
+
+	free_records();
+	if (!state_dir)
+		return;
+
+	fp = fopen(state_path(STATS, path, sizeof(path)), "a");
+	if (!fp) {
+		my_perror(path);
+		return;
+	}
+
+	for (conn = comics; conn; conn = conn->next) {
+		struct stats *s = &conn->stats;
+		const char *ihost;
+
+		if (s->start == 0)
+			continue; /* never started */
+
+		stats_name(conn, name, sizeof(name));
+		ihost = s->index_host ? bare_host(s->index_host) : stats_host(conn);
+		fprintf(fp, "%ld\t%s\t%.*s\t%d\t%ld\t%ld\t%ld\t%ld\t%lld\t%ld\t%s\t%.*s\n",
+				(long)run_start, name,
+				(int)strcspn(stats_host(conn), "/"), stats_host(conn),
+				s->status, ms(conn, s->connect), ms(conn, s->reply),
+				ms(conn, s->index), ms(conn, s->done),
+				(long long)s->bytes, s->match,
+				conn->gotit ? "-" : s->reason ? s->reason : "failed",
+				(int)strcspn(ihost, "/"), ihost);
+	}
+
+	if (fclose(fp))
+		my_perror(path);
+
+	free_records();
+}
+
+/* Query */
+
+/* Prints one line per group of records with the same key */
+static void show(const char *title, int (*cmp)(const void *, const void *),
+				 int by_host)
+{
+	long *totals = must_calloc(n_records + 1, sizeof(long));
+	int i, j, k, n, failed;
+
+	qsort(records, n_records, sizeof(struct record), cmp);
+
+	printf("%-24s %5s %6s %8s %8s\n", title, "runs", "fail%", "p50 ms", "p95 ms");
+	for (i = 0; i < n_records; i = j) {
+		failed = n = 0;
+		for (j = i; j < n_records && cmp(&records[i], &records[j]) == 0; ++j)
+			if (records[j].failed)
+				++failed;
+			else
+				totals[n++] = records[j].total;
+
+		qsort(totals, n, sizeof(long), cmp_long);
+		printf("%-24.24s %5d %5.1f%%",
+			   by_host ? records[i].host : records[i].name,
+			   j - i, failed * 100.0 / (j - i));
+		if (n) {
+			k = (n * 95 + 99) / 100 - 1;
+			printf(" %8ld %8ld\n", totals[(n - 1) / 2], totals[k]);
+		} else
+			printf(" %8s %8s\n", "-", "-");
+	}
+
+	free(totals);
+}
+
+int stats_query(int days)
+{
+	if (!state_dir) {
+		printf("Stats need a state directory (-s)\n");
+		return 1;
+	}
+
+	if (load_records(days)) {
+		printf("No stats yet\n");
+		return 1;
+	}
+
+	printf("Last %d days\n\n", days);
+	show("comic", cmp_name, 0);
+	putchar('\n');
+	show("host", cmp_host, 1);
+
+	free_records();
+	return 0;
+}
+
+/* Start order */
+
+struct expect {
+	struct connection *conn;
+	long ms;
+	int order; /* config order, to keep the sort stable */
+};
+
+/* Median of the totals for this comic, or for comics with the same
+ * config url host if the comic has no history. -1 if we know nothing.
+ * Called before any comic starts, so conn->host is the config host. */
+static long expected_ms(struct connection *conn)
+{
+	long *totals = must_calloc(n_records + 1, sizeof(long)), ms = -1;
+	const char *host = stats_host(conn);
+	int i, n = 0, hostlen = strcspn(host, "/");
+	char name[128];
+
+	stats_name(conn, name, sizeof(name));
+	for (i = 0; i < n_records; ++i)
+		if (strcmp(records[i].name, name) == 0 && records[i].total >= 0)
+			totals[n++] = records[i].total;
+
+	if (n == 0)
+		for (i = 0; i < n_records; ++i)
+			if (strncmp(records[i].index_host, host, hostlen) == 0 &&
+				records[i].index_host[hostlen] == '\0' && records[i].total >= 0)
+				totals[n++] = records[i].total;
+
+	if (n) {
+		qsort(totals, n, sizeof(long), cmp_long);
+		ms = totals[(n - 1) / 2];
+	}
+
+	free(totals);
+	return ms;
+}
+
+static int cmp_expect(const void *a, const void *b)
+{
+	const struct expect *ea = a, *eb = b;
+
+	if (ea->ms != eb->ms) {
+		/* Unknown first, then longest first */
+		if (ea->ms < 0)
+			return -1;
+		if (eb->ms < 0)
+			return 1;
+		return ea->ms > eb->ms ? -1 : 1;
+	}
+	return ea->order - eb->order;
+}
+
+/* Start the comics we expect to take the longest first. With a fixed
+ * number of connections this gets the whole run done sooner than one
+ * slow comic at the end of the config. Must be called before any
+ * comic is started. */
+void stats_order(void)
+{
+	struct connection *conn, **link;
+	struct expect *expect;
+	int i, n = 0;
+
+	if (n_records == 0 || head != comics)
+		return;
+
+	for (conn = comics; conn; conn = conn->next)
+		++n;
+	expect = must_calloc(n, sizeof(struct expect));
+
+	for (i = 0, conn = comics; conn; conn = conn->next, ++i) {
+		expect[i].conn = conn;
+		expect[i].ms = expected_ms(conn);
+		expect[i].order = i;
+	}
+
+	qsort(expect, n, sizeof(struct expect), cmp_expect);
+
+	link = &comics;
+	for (i = 0; i < n; ++i) {
+		if (verbose > 1)
+			printf("Order %s %ld ms\n", expect[i].conn->url, expect[i].ms);
+		*link = expect[i].conn;
+		link = &expect[i].conn->next;
+	}
+	*link = NULL;
+	head = comics;
+
+	free(expect);
+}
+
+/* The host of the last successful run of conn, NULL if none. For a two
+ * stage comic this is the image host. */
+const char *stats_last_host(struct connection *conn)
+{
+	char name[128];
+	int i;
+
+	stats_name(conn, name, sizeof(name));
+	for (i = n_records - 1; i >= 0; --i)
+		if (!records[i].failed && strcmp(records[i].name, name) == 0)
+			return records[i].host;
+
+	return NULL;
+}
+
+/* pct percentile of the time the successful runs spent on host, -1
+ * if none. For a two stage comic that is from the index page to the
+ * end, since host is where the image came from. */
+long stats_percentile(const char *host, int pct)
+{
+	long *totals = must_calloc(n_records + 1, sizeof(long)), ms = -1;
+	int i, n = 0;
+
+	for (i = 0; i < n_records; ++i)
+		if (!records[i].failed && records[i].total >= 0 &&
+			strcmp(records[i].host, host) == 0)
+			totals[n++] = records[i].total -
+				(records[i].index > 0 ? records[i].index : 0);
+
+	if (n) {
+		qsort(totals, n, sizeof(long), cmp_long);
+		ms = totals[(n * pct + 99) / 100 - 1];
+	}
+
+	free(totals);
+	return ms;
+}
@@ -0,0 +1,236 @@
+#include "get-comics.h"
+#ifndef _WIN32
+#include <dirent.h>
+#include <utime.h>
+#endif
+
+/* Content addressed image store. It lives in state_dir/store.
+ *
+ * Every image is hashed while it is written and hard linked into the
+ * store as <hash><ext>. If the store already has those bytes, the new
+ * file is replaced by a link to the store copy. So an image is only
+ * kept once, no matter how many days or comics use it.
+ *
+ * The hash is also saved with the validators. If a conditional GET
+ * says the image has not changed, but it is not in the comics dir
+ * (e.g. a new dated directory), we just link it from the store.
+ */
+
+#ifndef _WIN32
+static char *store_dir;
+
+/* Prune unused entries older than this */
+#define STORE_AGE	(30 * 24 * 60 * 60)
+
+#define FNV64_INIT	0xcbf29ce484222325ULL
+#define FNV64_PRIME	0x100000001b3ULL
+
+static char *store_path(uint64_t hash, const char *fname, char *path, int len)
+{
+	const char *ext = strrchr(fname, '.');
+
+	if (!ext || strlen(ext) > 5 || strchr(ext, '/'))
+		ext = "";
+
+	snprintf(path, len, "%s/%016llx%s", store_dir,
+			 (unsigned long long)hash, ext);
+	return path;
+}
+
+/* Anything only linked from the store is not in any comics dir */
+static void store_prune(void)
+{
+	char path[PATH_MAX];
+	time_t old = time(NULL) - STORE_AGE;
+	struct dirent *ent;
+	struct stat sb;
+	DIR *dir;
+
+	if (!(dir = opendir(store_dir)))
+		return;
+
+	while ((ent = readdir(dir))) {
+		if (*ent->d_name == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", store_dir, ent->d_name);
+		if (stat(path, &sb) == 0 && sb.st_nlink == 1 && sb.st_mtime < old) {
+			if (verbose > 1)
+				printf("Prune %s\n", path);
+			unlink(path);
+		}
+	}
+
+	closedir(dir);
+}
+
+void store_init(void)
+{
+	char path[PATH_MAX];
+
+	if (!state_dir)
+		return;
+
+	state_path("store", path, sizeof(path));
+	if (access(path, F_OK) && mkdir(path, 0775)) {
+		my_perror(path);
+		return;
+	}
+
+	store_dir = must_strdup(path);
+	store_prune();
+}
+
+void store_exit(void)
+{
+	free(store_dir);
+	store_dir = NULL;
+}
+
+/* Called when the output file is opened */
+void store_start(struct connection *conn)
+{
+	conn->hashing = store_dir != NULL;
+	conn->hash = FNV64_INIT;
+}
+
+void store_update(struct connection *conn, const void *buf, int len)
+{
+	const unsigned char *p = buf;
+	uint64_t hash = conn->hash;
+
+	if (!conn->hashing)
+		return;
+
+	while (len-- > 0) {
+		hash ^= *p++;
+		hash *= FNV64_PRIME;
+	}
+
+	conn->hash = hash;
+}
+
+/* The hash only says they are probably the same */
+static int same_contents(const char *a, const char *b)
+{
+	char buf1[8192], buf2[8192];
+	int fd1, fd2, n, same = 0;
+
+	fd1 = open(a, O_RDONLY);
+	fd2 = open(b, O_RDONLY);
+	if (fd1 < 0 || fd2 < 0)
+		goto done;
+
+	while ((n = read(fd1, buf1, sizeof(buf1))) > 0)
+		if (read(fd2, buf2, n) != n || memcmp(buf1, buf2, n))
+			goto done;
+	same = n == 0 && read(fd2, buf2, 1) == 0;
+
+done:
+	if (fd1 >= 0)
+		close(fd1);
+	if (fd2 >= 0)
+		close(fd2);
+	return same;
+}
+
+/* Called when the output file is complete */
+void store_finish(struct connection *conn)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct stat sb, osb;
+
+	if (!conn->hashing)
+		return;
+	conn->hashing = 0;
+
+	if (stat(conn->outname, &osb)) {
+		conn->hash = 0;
+		return;
+	}
+
+	store_path(conn->hash, conn->outname, path, sizeof(path));
+	if (stat(path, &sb)) {
+		/* New image */
+		if (link(conn->outname, path)) {
+			my_perror(path);
+			if (errno == EXDEV) {
+				printf("The store must be on the same filesystem\n");
+				store_exit();
+			}
+			conn->hash = 0;
+		}
+		return;
+	}
+
+	if (sb.st_ino == osb.st_ino)
+		return; /* already linked */
+
+	if (sb.st_size != osb.st_size || !same_contents(conn->outname, path)) {
+		printf("%s: hash collision with %s\n", conn->outname, path);
+		conn->hash = 0;
+		return;
+	}
+
+	/* Replace our copy with the store copy */
+	snprintf(tmp, sizeof(tmp), "%s.lnk", conn->outname);
+	if (link(path, tmp)) {
+		my_perror(tmp);
+		return;
+	}
+	if (rename(tmp, conn->outname)) {
+		my_perror(conn->outname);
+		unlink(tmp);
+		return;
+	}
+
+	utime(path, NULL); /* keep it from being pruned */
+
+	if (verbose > 1)
+		printf("Dedup %s -> %s\n", conn->outname, path);
+}
+
+int store_has(uint64_t hash, const char *fname)
+{
+	char path[PATH_MAX];
+
+	if (!store_dir || !hash)
+		return 0;
+
+	return access(store_path(hash, fname, path, sizeof(path)), F_OK) == 0;
+}
+
+/* Make sure fname exists, linking it from the store if needed */
+int store_link(uint64_t hash, const char *fname)
+{
+	char path[PATH_MAX];
+
+	if (access(fname, F_OK) == 0)
+		return 0;
+
+	if (!store_has(hash, fname))
+		return 1;
+
+	store_path(hash, fname, path, sizeof(path));
+	if (link(path, fname)) {
+		my_perror(fname);
+		return 1;
+	}
+
+	utime(path, NULL); /* keep it from being pruned */
+
+	if (verbose > 1)
+		printf("Linked %s -> %s\n", fname, path);
+	return 0;
+}
+#else
+void store_init(void) {}
+void store_exit(void) {}
+void store_start(struct connection *conn) {}
+void store_update(struct connection *conn, const void *buf, int len) {}
+void store_finish(struct connection *conn) {}
+int store_has(uint64_t hash, const char *fname) { return 0; }
+int store_link(uint64_t hash, const char *fname)
+{
+	return access(fname, F_OK);
+}
+#endif